@@ -0,0 +1,570 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_INPUT_PATH "measurements.txt"
+#define DEFAULT_BINARY_DIRECTORY "."
+#define DEFAULT_ENGINES                                                        \
+    "first_implementation,threads_first_implementation,sequential,locked,"   \
+    "pipeline,thread-local,static,work-stealing,stream,uring"
+#define DEFAULT_CHUNK_SIZES "200M"
+#define DEFAULT_MAPPINGS "default"
+#define ALL_MAPPINGS                                                           \
+    "default,madvise=sequential,madvise=willneed,populate,release,"           \
+    "huge-pages"
+#define DEFAULT_REPEAT 3
+#define MAX_LIST_ITEMS 64
+#define MAX_ARGUMENTS 32
+#define MAX_MAPPING_OPTIONS 8
+#define MAX_OPTION_LENGTH 64
+
+typedef struct List {
+    char *items[MAX_LIST_ITEMS];
+    int count;
+} List;
+
+typedef struct RunResult {
+    double seconds;
+    long max_rss_kb;
+    long minor_faults;
+    long major_faults;
+    bool failed;
+} RunResult;
+
+typedef struct Options {
+    const char *input_path;
+    const char *binary_directory;
+    List engines;
+    List threads;
+    List chunk_sizes;
+    List mappings;
+    int repeat;
+    unsigned long long rows;
+    bool csv;
+    /* Output of the first configuration that ran, the others must match it. */
+    char reference_path[4096];
+    bool have_reference;
+} Options;
+
+/* Splits a comma separated list in place. */
+void split_list(char *text, List *list) {
+    list->count = 0;
+    char *item = strtok(text, ",");
+    while (item != NULL && list->count < MAX_LIST_ITEMS) {
+        list->items[list->count++] = item;
+        item = strtok(NULL, ",");
+    }
+}
+
+/*
+ * Appends the main options of one mapping variant: `default` adds nothing,
+ * otherwise every `+` separated part becomes a long option, so
+ * `populate+madvise=willneed` runs with --populate --madvise=willneed.
+ */
+int append_mapping_arguments(const char *mapping,
+                             char storage[][MAX_OPTION_LENGTH],
+                             char *arguments[], int argument_count) {
+    if (strcmp(mapping, "default") == 0) {
+        return argument_count;
+    }
+
+    char parts[MAX_OPTION_LENGTH * MAX_MAPPING_OPTIONS];
+    snprintf(parts, sizeof(parts), "%s", mapping);
+    char *state;
+    int count = 0;
+    for (char *part = strtok_r(parts, "+", &state);
+         part != NULL && count < MAX_MAPPING_OPTIONS;
+         part = strtok_r(NULL, "+", &state)) {
+        snprintf(storage[count], MAX_OPTION_LENGTH, "--%s", part);
+        arguments[argument_count++] = storage[count++];
+    }
+    return argument_count;
+}
+
+/*
+ * The standalone implementations read measurements.txt from the working
+ * directory, everything else is an engine of the main driver.
+ */
+bool is_standalone_binary(const char *engine) {
+    return strcmp(engine, "first_implementation") == 0 ||
+           strcmp(engine, "threads_first_implementation") == 0;
+}
+
+double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Counts newlines once so rows/s can be reported without --rows. */
+unsigned long long count_rows(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening input");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    const char *memory = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long rows = 0;
+    const char *cursor = memory;
+    const char *end = memory + st.st_size;
+    while ((cursor = memchr(cursor, '\n', end - cursor)) != NULL) {
+        rows++;
+        cursor++;
+    }
+
+    munmap((void *)memory, st.st_size);
+    close(fd);
+    return rows;
+}
+
+/*
+ * Runs one measurement in a child with stdout written to output_path and
+ * collects wall time plus the child's rusage (peak RSS and page faults).
+ */
+RunResult run_once(char *const arguments[], const char *working_directory,
+                   const char *output_path) {
+    RunResult result = {0};
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int output_fd =
+            open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (output_fd < 0) {
+            _exit(127);
+        }
+        dup2(output_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (working_directory != NULL && chdir(working_directory) != 0) {
+            _exit(127);
+        }
+        execv(arguments[0], arguments);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("wait4 failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result.seconds = elapsed_seconds(&start, &end);
+    result.max_rss_kb = usage.ru_maxrss;
+    result.minor_faults = usage.ru_minflt;
+    result.major_faults = usage.ru_majflt;
+    result.failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    return result;
+}
+
+/* Byte for byte comparison of two result files. */
+bool same_output(const char *left_path, const char *right_path) {
+    FILE *left = fopen(left_path, "rb");
+    FILE *right = fopen(right_path, "rb");
+    bool same = left != NULL && right != NULL;
+    while (same) {
+        int left_char = fgetc(left);
+        int right_char = fgetc(right);
+        same = left_char == right_char;
+        if (left_char == EOF) {
+            break;
+        }
+    }
+    if (left != NULL) {
+        fclose(left);
+    }
+    if (right != NULL) {
+        fclose(right);
+    }
+    return same;
+}
+
+/*
+ * The first configuration that succeeds becomes the reference, every later
+ * one has to print exactly the same results.
+ */
+bool check_output(Options *options, const char *output_path) {
+    if (!options->have_reference) {
+        if (rename(output_path, options->reference_path) != 0) {
+            perror("rename failed");
+            exit(EXIT_FAILURE);
+        }
+        options->have_reference = true;
+        return true;
+    }
+    return same_output(output_path, options->reference_path);
+}
+
+int compare_results(const void *a, const void *b) {
+    double left = ((const RunResult *)a)->seconds;
+    double right = ((const RunResult *)b)->seconds;
+    return (left > right) - (left < right);
+}
+
+void print_header(const Options *options) {
+    if (options->csv) {
+        printf("engine,threads,chunk_size,mapping,median_s,best_s,"
+               "rows_per_s,gb_per_s,peak_rss_mb,minor_faults,major_faults,"
+               "status\n");
+        return;
+    }
+    printf("%-30s %7s %6s %-18s %9s %9s %12s %7s %9s %11s %8s %s\n",
+           "engine", "threads", "chunk", "mapping", "median_s", "best_s",
+           "rows/s", "GB/s", "rss_mb", "minor_flt", "major_flt", "status");
+}
+
+/*
+ * Failed runs are left out of the median and best times, a configuration
+ * where every run failed prints no timings at all.
+ */
+void print_row(const Options *options, const char *engine,
+               const char *threads, const char *chunk_size,
+               const char *mapping, RunResult *runs, int count,
+               bool output_matches, unsigned long long rows,
+               size_t file_size) {
+    int succeeded = 0;
+    for (int r = 0; r < count; r++) {
+        if (!runs[r].failed) {
+            runs[succeeded++] = runs[r];
+        }
+    }
+    const char *status = succeeded < count  ? "failed"
+                         : !output_matches ? "mismatch"
+                                           : "ok";
+
+    if (succeeded == 0) {
+        if (options->csv) {
+            printf("%s,%s,%s,%s,,,,,,,,%s\n", engine, threads, chunk_size,
+                   mapping, status);
+        } else {
+            printf("%-30s %7s %6s %-18s %9s %9s %12s %7s %9s %11s %8s %s\n",
+                   engine, threads, chunk_size, mapping, "-", "-", "-", "-",
+                   "-", "-", "-", status);
+        }
+        fflush(stdout);
+        return;
+    }
+
+    qsort(runs, succeeded, sizeof(RunResult), compare_results);
+    RunResult *median = &runs[succeeded / 2];
+    double rows_per_second = rows / median->seconds;
+    double gigabytes_per_second = file_size / median->seconds / 1e9;
+
+    if (options->csv) {
+        printf("%s,%s,%s,%s,%.3f,%.3f,%.0f,%.3f,%.1f,%ld,%ld,%s\n", engine,
+               threads, chunk_size, mapping, median->seconds, runs[0].seconds,
+               rows_per_second, gigabytes_per_second,
+               median->max_rss_kb / 1024.0, median->minor_faults,
+               median->major_faults, status);
+    } else {
+        printf("%-30s %7s %6s %-18s %9.3f %9.3f %12.0f %7.3f %9.1f %11ld "
+               "%8ld %s\n",
+               engine, threads, chunk_size, mapping, median->seconds,
+               runs[0].seconds, rows_per_second, gigabytes_per_second,
+               median->max_rss_kb / 1024.0, median->minor_faults,
+               median->major_faults, status);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Runs one configuration repeat times, checking the printed results of every
+ * successful run against the reference before the row is printed.
+ */
+void run_configuration(Options *options, char *const arguments[],
+                       const char *working_directory,
+                       const char *output_path, RunResult *runs,
+                       const char *engine, const char *threads,
+                       const char *chunk_size, const char *mapping,
+                       unsigned long long rows, size_t file_size) {
+    bool output_matches = true;
+    for (int r = 0; r < options->repeat; r++) {
+        runs[r] = run_once(arguments, working_directory, output_path);
+        if (runs[r].failed) {
+            fprintf(stderr, "%s (threads %s, chunk %s, mapping %s) failed\n",
+                    engine, threads, chunk_size, mapping);
+        } else if (!check_output(options, output_path)) {
+            output_matches = false;
+        }
+    }
+    if (!output_matches) {
+        fprintf(stderr,
+                "%s (threads %s, chunk %s, mapping %s) printed different "
+                "results than the first configuration\n",
+                engine, threads, chunk_size, mapping);
+    }
+    print_row(options, engine, threads, chunk_size, mapping, runs,
+              options->repeat, output_matches, rows, file_size);
+}
+
+/*
+ * Standalone binaries only know measurements.txt in their working
+ * directory, so they run from a scratch directory with a link to the input.
+ */
+char *prepare_standalone_directory(const char *input_path) {
+    char *directory = strdup("/tmp/1brc-bench-XXXXXX");
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp failed");
+        exit(EXIT_FAILURE);
+    }
+
+    char absolute_input[4096];
+    if (realpath(input_path, absolute_input) == NULL) {
+        perror("Error resolving input");
+        exit(EXIT_FAILURE);
+    }
+
+    char link_path[4096];
+    snprintf(link_path, sizeof(link_path), "%s/measurements.txt", directory);
+    if (symlink(absolute_input, link_path) != 0) {
+        perror("symlink failed");
+        exit(EXIT_FAILURE);
+    }
+    return directory;
+}
+
+void remove_standalone_directory(char *directory) {
+    char link_path[4096];
+    snprintf(link_path, sizeof(link_path), "%s/measurements.txt", directory);
+    unlink(link_path);
+    snprintf(link_path, sizeof(link_path), "%s/output", directory);
+    unlink(link_path);
+    snprintf(link_path, sizeof(link_path), "%s/reference", directory);
+    unlink(link_path);
+    rmdir(directory);
+    free(directory);
+}
+
+void benchmark_engine(Options *options, const char *engine,
+                      const char *standalone_directory,
+                      unsigned long long rows, size_t file_size) {
+    char binary[4096];
+    char absolute_input[4096];
+    char output_path[4096];
+    RunResult *runs = malloc(sizeof(RunResult) * options->repeat);
+    snprintf(output_path, sizeof(output_path), "%s/output",
+             standalone_directory);
+
+    if (realpath(options->input_path, absolute_input) == NULL) {
+        perror("Error resolving input");
+        exit(EXIT_FAILURE);
+    }
+
+    if (is_standalone_binary(engine)) {
+        snprintf(binary, sizeof(binary), "%s/%s", options->binary_directory,
+                 engine);
+        char absolute_binary[4096];
+        if (realpath(binary, absolute_binary) == NULL) {
+            fprintf(stderr, "Missing binary %s, skipping\n", binary);
+            free(runs);
+            return;
+        }
+        char *arguments[] = {absolute_binary, NULL};
+
+        run_configuration(options, arguments, standalone_directory,
+                          output_path, runs, engine, "-", "-", "-", rows,
+                          file_size);
+        free(runs);
+        return;
+    }
+
+    snprintf(binary, sizeof(binary), "%s/main", options->binary_directory);
+    for (int t = 0; t < options->threads.count; t++) {
+        for (int c = 0; c < options->chunk_sizes.count; c++) {
+            for (int m = 0; m < options->mappings.count; m++) {
+                char *arguments[MAX_ARGUMENTS];
+                char storage[MAX_MAPPING_OPTIONS][MAX_OPTION_LENGTH];
+                int argument_count = 0;
+                arguments[argument_count++] = binary;
+                arguments[argument_count++] = "--engine";
+                arguments[argument_count++] = (char *)engine;
+                arguments[argument_count++] = "--threads";
+                arguments[argument_count++] = options->threads.items[t];
+                arguments[argument_count++] = "--chunk-size";
+                arguments[argument_count++] = options->chunk_sizes.items[c];
+                argument_count = append_mapping_arguments(
+                    options->mappings.items[m], storage, arguments,
+                    argument_count);
+                arguments[argument_count++] = absolute_input;
+                arguments[argument_count] = NULL;
+
+                run_configuration(options, arguments, NULL, output_path, runs,
+                                  engine, options->threads.items[t],
+                                  options->chunk_sizes.items[c],
+                                  options->mappings.items[m], rows,
+                                  file_size);
+            }
+        }
+    }
+    free(runs);
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [FILE]\n\n", program);
+    fprintf(stderr,
+            "Times every engine over FILE (default %s) and reports the "
+            "median run.\n\n"
+            "  -e, --engines LIST      comma separated, main engines or the\n"
+            "                          standalone binaries (default: all)\n"
+            "  -t, --threads LIST      thread counts (default: 1 and online "
+            "CPUs)\n"
+            "  -c, --chunk-sizes LIST  chunk sizes (default %s)\n"
+            "  -m, --mappings LIST     mapping variants of main, each "
+            "`default` or\n"
+            "                          options joined by +, e.g.\n"
+            "                          populate+madvise=willneed; `all` "
+            "runs\n"
+            "                          every single option (default %s)\n"
+            "  -n, --repeat N          runs per configuration (default %d)\n"
+            "  -r, --rows N            rows in FILE, counted when omitted\n"
+            "  -b, --bin-dir DIR       where the binaries live (default "
+            "%s)\n"
+            "      --csv               print CSV instead of a table\n"
+            "  -h, --help              show this help\n",
+            DEFAULT_INPUT_PATH, DEFAULT_CHUNK_SIZES, DEFAULT_MAPPINGS,
+            DEFAULT_REPEAT, DEFAULT_BINARY_DIRECTORY);
+}
+
+enum {
+    OPTION_CSV = 256,
+};
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"engines", required_argument, NULL, 'e'},
+        {"threads", required_argument, NULL, 't'},
+        {"chunk-sizes", required_argument, NULL, 'c'},
+        {"mappings", required_argument, NULL, 'm'},
+        {"repeat", required_argument, NULL, 'n'},
+        {"rows", required_argument, NULL, 'r'},
+        {"bin-dir", required_argument, NULL, 'b'},
+        {"csv", no_argument, NULL, OPTION_CSV},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    char default_engines[] = DEFAULT_ENGINES;
+    char default_chunk_sizes[] = DEFAULT_CHUNK_SIZES;
+    char default_mappings[] = DEFAULT_MAPPINGS;
+    char all_mappings[] = ALL_MAPPINGS;
+    char default_threads[32];
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online_cpus > 1) {
+        snprintf(default_threads, sizeof(default_threads), "1,%ld",
+                 online_cpus);
+    } else {
+        snprintf(default_threads, sizeof(default_threads), "1");
+    }
+
+    Options options = {
+        .input_path = DEFAULT_INPUT_PATH,
+        .binary_directory = DEFAULT_BINARY_DIRECTORY,
+        .repeat = DEFAULT_REPEAT,
+    };
+    split_list(default_engines, &options.engines);
+    split_list(default_threads, &options.threads);
+    split_list(default_chunk_sizes, &options.chunk_sizes);
+    split_list(default_mappings, &options.mappings);
+
+    int option;
+    while ((option = getopt_long(argc, argv, "e:t:c:m:n:r:b:h", long_options,
+                                 NULL)) != -1) {
+        switch (option) {
+        case 'e':
+            split_list(optarg, &options.engines);
+            break;
+        case 't':
+            split_list(optarg, &options.threads);
+            break;
+        case 'c':
+            split_list(optarg, &options.chunk_sizes);
+            break;
+        case 'm':
+            split_list(strcmp(optarg, "all") == 0 ? all_mappings : optarg,
+                       &options.mappings);
+            break;
+        case 'n':
+            options.repeat = atoi(optarg);
+            if (options.repeat < 1) {
+                fprintf(stderr, "Invalid repeat count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            options.rows = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.binary_directory = optarg;
+            break;
+        case OPTION_CSV:
+            options.csv = true;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        options.input_path = argv[optind];
+    }
+
+    struct stat st;
+    if (stat(options.input_path, &st) != 0) {
+        perror("Error opening input");
+        return EXIT_FAILURE;
+    }
+    if (options.rows == 0) {
+        options.rows = count_rows(options.input_path);
+    }
+    fprintf(stderr, "Input: %s, %llu rows, %lld bytes\n", options.input_path,
+            options.rows, (long long)st.st_size);
+
+    char *standalone_directory =
+        prepare_standalone_directory(options.input_path);
+    snprintf(options.reference_path, sizeof(options.reference_path),
+             "%s/reference", standalone_directory);
+
+    print_header(&options);
+    for (int e = 0; e < options.engines.count; e++) {
+        benchmark_engine(&options, options.engines.items[e],
+                         standalone_directory, options.rows, st.st_size);
+    }
+
+    remove_standalone_directory(standalone_directory);
+    return 0;
+}
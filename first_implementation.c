@@ -1,100 +1,392 @@
 #include <assert.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#define TABLE_SIZE 50000000
+/* Comfortably above the ~10k distinct stations, grows if ever exceeded. */
+#define INITIAL_TABLE_CAPACITY 16384
+#define ARENA_BLOCK_SIZE ((size_t)1024 * 1024)
 
 typedef struct Station {
-    char name[50];
-    float average_temp;
-    float min_temp;
-    float max_temp;
-    float median_temp;
-    unsigned int count;
+    /* Tenths of a degree, the mean is only computed when printing. */
+    int64_t sum_temp;
+    int32_t min_temp;
+    int32_t max_temp;
+    uint64_t count;
 } Station;
 
+/*
+ * Open addressing with linear probing. The aggregates live inline in the
+ * slots, and the capacity is a power of two so the probe index is a mask of
+ * the hash.
+ */
 typedef struct Entry {
     char *key;
-    Station *value;
-    struct Entry *next;
+    uint32_t hash;
+    uint32_t key_length;
+    Station value;
 } Entry;
 
+/*
+ * Bump allocator owning the keys of one table, so a new station costs a
+ * pointer bump instead of a malloc and teardown frees a few blocks instead
+ * of walking every slot.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *blocks;
+    char *cursor;
+    char *limit;
+} Arena;
+
 typedef struct HashTable {
-    Entry **entries;
+    Entry *entries;
+    size_t capacity;
+    size_t count;
+    Arena keys;
 } HashTable;
 
-unsigned int hash(const char *key) {
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *key++)) {
-        hash = ((hash << 5) + hash) + c;
+#define HASH_SEED 0x9747b28cULL
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t load_word(const char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t hash_word(uint64_t state, uint64_t word) {
+    state = (state ^ word) * HASH_MULTIPLIER;
+    return state ^ (state >> 29);
+}
+
+/* Hashes the name eight bytes at a time, the last word zero padded. */
+uint32_t hash(const char *key, size_t length) {
+    uint64_t state = HASH_SEED;
+    size_t offset = 0;
+    for (; offset + 8 <= length; offset += 8) {
+        state = hash_word(state, load_word(key + offset));
+    }
+    if (offset < length) {
+        uint64_t word = 0;
+        memcpy(&word, key + offset, length - offset);
+        state = hash_word(state, word);
+    }
+    state ^= state >> 32;
+    state *= HASH_MULTIPLIER;
+    return (uint32_t)(state >> 32);
+}
+
+/* Length first, then the first 16 bytes a word at a time, then the rest. */
+static inline bool key_equals(const char *stored, const char *key,
+                              size_t key_length) {
+    size_t offset = 0;
+    for (; offset < 16 && offset + 8 <= key_length; offset += 8) {
+        if (load_word(stored + offset) != load_word(key + offset)) {
+            return false;
+        }
+    }
+    return memcmp(stored + offset, key + offset, key_length - offset) == 0;
+}
+
+void *arena_allocate(Arena *arena, size_t size) {
+    if ((size_t)(arena->limit - arena->cursor) < size) {
+        size_t block_size = sizeof(ArenaBlock) + size > ARENA_BLOCK_SIZE
+                                ? sizeof(ArenaBlock) + size
+                                : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = malloc(block_size);
+        block->next = arena->blocks;
+        block->size = block_size;
+        arena->blocks = block;
+        arena->cursor = (char *)(block + 1);
+        arena->limit = (char *)block + block_size;
+    }
+    void *memory = arena->cursor;
+    arena->cursor += size;
+    return memory;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
     }
-    return hash % TABLE_SIZE;
 }
 
 HashTable *create_table() {
     HashTable *table = malloc(sizeof(HashTable));
-    table->entries = malloc(sizeof(Entry *) * TABLE_SIZE);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        table->entries[i] = NULL;
-    }
+    table->entries = calloc(INITIAL_TABLE_CAPACITY, sizeof(Entry));
+    table->capacity = INITIAL_TABLE_CAPACITY;
+    table->count = 0;
+    table->keys = (Arena){0};
     return table;
 }
 
 void free_table(HashTable *table) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        Entry *entry = table->entries[i];
-        while (entry != NULL) {
-            Entry *temp = entry;
-            entry = entry->next;
-            free(temp->key);
-            free(temp);
-        }
-    }
+    arena_free(&table->keys);
     free(table->entries);
     free(table);
 }
 
-void ht_set(HashTable *table, const char *key, Station *value) {
-    unsigned int index = hash(key);
-    Entry *entry = table->entries[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            entry->value = value;
-            return;
+/* Finds the slot holding `key`, or the empty slot where it belongs. */
+Entry *ht_find_slot(HashTable *table, const char *key, size_t key_length,
+                    uint32_t key_hash) {
+    size_t mask = table->capacity - 1;
+    size_t index = key_hash & mask;
+    for (;;) {
+        Entry *entry = &table->entries[index];
+        if (entry->key == NULL) {
+            return entry;
+        }
+        if (entry->hash == key_hash && entry->key_length == key_length &&
+            key_equals(entry->key, key, key_length)) {
+            return entry;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+void ht_grow(HashTable *table) {
+    Entry *old_entries = table->entries;
+    size_t old_capacity = table->capacity;
+
+    table->capacity = old_capacity * 2;
+    table->entries = calloc(table->capacity, sizeof(Entry));
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].key == NULL) {
+            continue;
         }
-        entry = entry->next;
+        size_t index = old_entries[i].hash & mask;
+        while (table->entries[index].key != NULL) {
+            index = (index + 1) & mask;
+        }
+        table->entries[index] = old_entries[i];
+    }
+    free(old_entries);
+}
+
+void ht_set(HashTable *table, const char *key, size_t key_length,
+            Station *value) {
+    uint32_t key_hash = hash(key, key_length);
+    Entry *entry = ht_find_slot(table, key, key_length, key_hash);
+
+    if (entry->key != NULL) {
+        entry->value = *value;
+        return;
+    }
+
+    if ((table->count + 1) * 2 > table->capacity) {
+        ht_grow(table);
+        entry = ht_find_slot(table, key, key_length, key_hash);
+    }
+
+    entry->key = arena_allocate(&table->keys, key_length + 1);
+    memcpy(entry->key, key, key_length);
+    entry->key[key_length] = '\0';
+    entry->hash = key_hash;
+    entry->key_length = key_length;
+    entry->value = *value;
+    table->count++;
+}
+
+Station *ht_get(HashTable *table, const char *key, size_t key_length) {
+    Entry *entry = ht_find_slot(table, key, key_length, hash(key, key_length));
+    return entry->key == NULL ? NULL : &entry->value;
+}
+
+/*
+ * Rounds sum / count half up (floor(x + 0.5)), the rounding the challenge
+ * reference output uses for the mean.
+ */
+int64_t round_mean(int64_t sum, uint64_t count) {
+    int64_t numerator = 2 * sum + (int64_t)count;
+    int64_t denominator = 2 * (int64_t)count;
+    int64_t quotient = numerator / denominator;
+    if (numerator % denominator != 0 && numerator < 0) {
+        quotient--;
+    }
+    return quotient;
+}
+
+/* Writes tenths of a degree as -?d+.d, returns the number of bytes. */
+size_t format_tenths(char *out, int64_t tenths) {
+    size_t length = 0;
+    if (tenths < 0) {
+        out[length++] = '-';
+        tenths = -tenths;
+    }
+    if (tenths >= 100) {
+        out[length++] = '0' + tenths / 100;
     }
+    out[length++] = '0' + (tenths / 10) % 10;
+    out[length++] = '.';
+    out[length++] = '0' + tenths % 10;
+    return length;
+}
 
-    entry = malloc(sizeof(Entry));
-    entry->key = strdup(key);
-    entry->value = value;
-    entry->next = table->entries[index];
-    table->entries[index] = entry;
+/* Orders by the raw UTF-8 bytes of the name, i.e. by code point. */
+int compare_entries(const void *a, const void *b) {
+    const Entry *left = *(const Entry *const *)a;
+    const Entry *right = *(const Entry *const *)b;
+    size_t length = left->key_length < right->key_length ? left->key_length
+                                                         : right->key_length;
+    int result = memcmp(left->key, right->key, length);
+    if (result != 0) {
+        return result;
+    }
+    return (left->key_length > right->key_length) -
+           (left->key_length < right->key_length);
 }
 
-Station *ht_get(HashTable *table, const char *key) {
-    unsigned int index = hash(key);
-    Entry *entry = table->entries[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry->value;
+/*
+ * Prints {name=min/mean/max, ...} sorted by name. The whole line is
+ * formatted into one buffer sized up front and handed to a single write.
+ */
+void print_results(HashTable *table) {
+    Entry **sorted = malloc(sizeof(Entry *) * (table->count + 1));
+    size_t count = 0;
+    size_t buffer_size = 3;
+    for (size_t i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL) {
+            continue;
         }
-        entry = entry->next;
+        sorted[count++] = entry;
+        /* name, '=', three values of at most 5 bytes, two '/', ", " */
+        buffer_size += entry->key_length + 1 + 3 * 5 + 2 + 2;
     }
-    return 0;
+    qsort(sorted, count, sizeof(Entry *), compare_entries);
+
+    char *buffer = malloc(buffer_size);
+    size_t used = 0;
+    buffer[used++] = '{';
+    for (size_t i = 0; i < count; i++) {
+        Entry *entry = sorted[i];
+        Station *s = &entry->value;
+        if (i > 0) {
+            buffer[used++] = ',';
+            buffer[used++] = ' ';
+        }
+        memcpy(buffer + used, entry->key, entry->key_length);
+        used += entry->key_length;
+        buffer[used++] = '=';
+        used += format_tenths(buffer + used, s->min_temp);
+        buffer[used++] = '/';
+        used += format_tenths(buffer + used, round_mean(s->sum_temp, s->count));
+        buffer[used++] = '/';
+        used += format_tenths(buffer + used, s->max_temp);
+    }
+    buffer[used++] = '}';
+    buffer[used++] = '\n';
+
+    fflush(stdout);
+    for (size_t written = 0; written < used;) {
+        ssize_t result = write(STDOUT_FILENO, buffer + written, used - written);
+        if (result < 0) {
+            perror("Error writing results");
+            exit(EXIT_FAILURE);
+        }
+        written += result;
+    }
+
+    free(buffer);
+    free(sorted);
 }
 
-float calculate_average(int count, float average, float new_value) {
-    return ((average * count) + new_value) / (count + 1);
+
+int32_t return_max(int32_t a, int32_t b) { return (a > b) ? a : b; }
+
+int32_t return_min(int32_t a, int32_t b) { return (a < b) ? a : b; }
+
+/*
+ * Slow path for anything that is not -?d.d or -?dd.d: accepts -?\d+(\.\d)?
+ * within -99.9..99.9 and rejects everything else.
+ */
+bool parse_temperature_checked(const char *start, const char *end,
+                               int32_t *tenths) {
+    const char *cursor = start;
+    bool negative = cursor < end && *cursor == '-';
+    if (negative) {
+        cursor++;
+    }
+
+    int32_t value = 0;
+    const char *digits_start = cursor;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+        value = value * 10 + (*cursor - '0');
+        if (value > 99) {
+            return false;
+        }
+        cursor++;
+    }
+    if (cursor == digits_start) {
+        return false;
+    }
+
+    value *= 10;
+    if (cursor < end && *cursor == '.') {
+        cursor++;
+        if (cursor == end || *cursor < '0' || *cursor > '9') {
+            return false;
+        }
+        value += *cursor - '0';
+        cursor++;
+    }
+    if (cursor != end) {
+        return false;
+    }
+
+    *tenths = negative ? -value : value;
+    return true;
 }
 
-float return_max(float a, float b) { return (a > b) ? a : b; }
+/*
+ * Parses the temperature in [start, end) into tenths of a degree. The input
+ * is almost always -?d.d or -?dd.d, which is handled with a couple of
+ * compares and no float math; anything else falls back to the checked path.
+ */
+static inline bool parse_temperature(const char *start, const char *end,
+                                     int32_t *tenths) {
+    size_t length = end - start;
+    int32_t sign = 1;
+    const char *digits = start;
+    if (length > 0 && *digits == '-') {
+        sign = -1;
+        digits++;
+        length--;
+    }
+
+    if (length == 3 && digits[1] == '.') {
+        unsigned int ones = (unsigned char)digits[0] - '0';
+        unsigned int decimal = (unsigned char)digits[2] - '0';
+        if ((ones | decimal) < 10) {
+            *tenths = sign * (int32_t)(ones * 10 + decimal);
+            return true;
+        }
+    } else if (length == 4 && digits[2] == '.') {
+        unsigned int tens = (unsigned char)digits[0] - '0';
+        unsigned int ones = (unsigned char)digits[1] - '0';
+        unsigned int decimal = (unsigned char)digits[3] - '0';
+        if ((tens | ones | decimal) < 10) {
+            *tenths = sign * (int32_t)(tens * 100 + ones * 10 + decimal);
+            return true;
+        }
+    }
 
-float return_min(float a, float b) { return (a < b) ? a : b; }
+    return parse_temperature_checked(start, end, tenths);
+}
 
 void *process_data(void *threadarg) {
 
@@ -121,52 +413,44 @@ int main(void) {
 
     // Read and print each line
     while (fgets(buffer, sizeof(buffer), file) != NULL) {
-        char *station_name = strtok(buffer, ";");
-        assert(station_name != NULL);
+        size_t line_length = strcspn(buffer, "\n");
+        char *separator = memchr(buffer, ';', line_length);
+        // Lines without a station name are skipped, like in main.c
+        if (separator == NULL || separator == buffer) {
+            continue;
+        }
+        *separator = '\0';
 
-        char *temperature_str = strtok(NULL, "\n");
-        assert(temperature_str != NULL);
-        float temperature = atof(temperature_str);
+        char *station_name = buffer;
+        size_t name_length = separator - buffer;
 
-        int station_hash = hash(station_name);
+        int32_t tenths;
+        if (!parse_temperature(separator + 1, buffer + line_length, &tenths)) {
+            continue;
+        }
 
-        Station *existing_station = ht_get(table, station_name);
+        Station *existing_station = ht_get(table, station_name, name_length);
 
         if (existing_station != NULL) {
-            existing_station->average_temp =
-                calculate_average(existing_station->count,
-                                  existing_station->average_temp, temperature);
+            existing_station->sum_temp += tenths;
             existing_station->count += 1;
             existing_station->max_temp =
-                return_max(existing_station->max_temp, temperature);
+                return_max(existing_station->max_temp, tenths);
             existing_station->min_temp =
-                return_min(existing_station->min_temp, temperature);
+                return_min(existing_station->min_temp, tenths);
         } else {
-            Station *s = malloc(sizeof(Station));
-            strncpy(s->name, station_name, sizeof(s->name) - 1);
-            s->average_temp = calculate_average(0, 0.0, temperature);
-            s->min_temp = temperature;
-            s->max_temp = temperature;
-            s->count = 1;
-
-            ht_set(table, station_name, s);
-        }
-    }
+            Station s = {0};
+            s.sum_temp = tenths;
+            s.min_temp = tenths;
+            s.max_temp = tenths;
+            s.count = 1;
 
-    exit(0);
-
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        Entry *entry = table->entries[i];
-        while (entry != NULL) {
-            Station *s = entry->value;
-            printf("Station: %s, Avg Temp: %.2f, Min Temp: %.2f, Max Temp: "
-                   "%.2f, Count: %u\n",
-                   s->name, s->average_temp, s->min_temp, s->max_temp,
-                   s->count);
-            entry = entry->next;
+            ht_set(table, station_name, name_length, &s);
         }
     }
 
+    print_results(table);
+
     free_table(table);
     fclose(file);
     return 0;
@@ -0,0 +1,329 @@
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_OUTPUT_PATH "measurements.txt"
+#define DEFAULT_ROWS 1000000ULL
+#define DEFAULT_SEED 42
+#define MAX_STATION_NAME_LENGTH 100
+#define TEMPERATURE_STANDARD_DEVIATION 10.0
+#define OUTPUT_BUFFER_SIZE (4 * 1024 * 1024)
+#define MAX_LINE_LENGTH (MAX_STATION_NAME_LENGTH + 8)
+
+typedef struct WeatherStation {
+    char name[MAX_STATION_NAME_LENGTH + 1];
+    double mean_temperature;
+} WeatherStation;
+
+/* A sample of the stations used by the original challenge generator. */
+WeatherStation default_stations[] = {
+    {"Abha", 18.0},          {"Abidjan", 26.0},       {"Accra", 26.4},
+    {"Addis Ababa", 16.0},   {"Adelaide", 17.3},      {"Algiers", 18.2},
+    {"Alexandria", 20.0},    {"Almaty", 10.0},        {"Amsterdam", 10.2},
+    {"Anchorage", 2.8},      {"Athens", 19.2},        {"Auckland", 15.2},
+    {"Baghdad", 22.77},      {"Bangkok", 28.6},       {"Barcelona", 18.2},
+    {"Beijing", 12.9},       {"Belgrade", 12.5},      {"Berlin", 10.3},
+    {"Bogotá", 13.3},        {"Boston", 10.9},        {"Bratislava", 10.5},
+    {"Bridgetown", 27.0},    {"Brussels", 10.5},      {"Bucharest", 10.8},
+    {"Budapest", 11.3},      {"Buenos Aires", 17.3},  {"Bulawayo", 18.9},
+    {"Cairo", 21.4},         {"Canberra", 13.1},      {"Cape Town", 16.2},
+    {"Chicago", 9.8},        {"Conakry", 26.4},       {"Copenhagen", 9.1},
+    {"Cracow", 9.3},         {"Dakar", 24.0},         {"Dhaka", 25.9},
+    {"Dublin", 9.8},         {"Edinburgh", 9.3},      {"Hamburg", 9.7},
+    {"Hanoi", 23.6},         {"Helsinki", 5.9},       {"Hong Kong", 23.3},
+    {"Istanbul", 13.9},      {"Jakarta", 26.7},       {"Johannesburg", 15.5},
+    {"Kampala", 20.0},       {"Kyiv", 8.4},           {"Lagos", 26.8},
+    {"Lima", 19.9},          {"Lisbon", 17.5},        {"London", 11.3},
+    {"Madrid", 15.0},        {"Marrakesh", 19.6},     {"Mexico City", 17.5},
+    {"Montreal", 6.8},       {"Moscow", 5.8},         {"Mumbai", 27.1},
+    {"Nairobi", 17.8},       {"New York City", 12.9}, {"Oslo", 5.7},
+    {"Ouagadougou", 28.3},   {"Palembang", 27.3},     {"Paris", 12.3},
+    {"Petropavlovsk-Kamchatsky", 1.9},                {"Prague", 8.4},
+    {"Reykjavík", 4.3},      {"Riga", 6.2},           {"Rome", 15.2},
+    {"Roseau", 26.2},        {"São Paulo", 19.7},     {"Seoul", 12.5},
+    {"Singapore", 27.0},     {"St. John's", 5.0},     {"Stockholm", 6.6},
+    {"Sydney", 17.7},        {"Tehran", 17.0},        {"Tokyo", 15.4},
+    {"Toronto", 9.4},        {"Ürümqi", 7.4},         {"Vienna", 10.4},
+    {"Warsaw", 8.5},         {"Wellington", 12.9},    {"Xi'an", 14.1},
+    {"Yakutsk", -8.8},       {"Zürich", 9.3},
+};
+
+#define NUMBER_OF_DEFAULT_STATIONS                                             \
+    (sizeof(default_stations) / sizeof(default_stations[0]))
+
+/* splitmix64, small and good enough for synthetic data. */
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in (0, 1]. */
+double next_uniform(uint64_t *state) {
+    return ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+double next_gaussian(uint64_t *state, double mean, double deviation) {
+    double u1 = next_uniform(state);
+    double u2 = next_uniform(state);
+    return mean + deviation * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/* A short write, e.g. on a full disk, must not leave a truncated file. */
+void write_output(FILE *output, const char *buffer, size_t length) {
+    if (fwrite(buffer, 1, length, output) != length) {
+        perror("Error writing output file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Parses a count with an optional K, M or B (billion) suffix, 0 on error. */
+unsigned long long parse_count(const char *text) {
+    char *suffix;
+    unsigned long long value = strtoull(text, &suffix, 10);
+    switch (*suffix) {
+    case 'k':
+    case 'K':
+        value *= 1000ULL;
+        suffix++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1000000ULL;
+        suffix++;
+        break;
+    case 'b':
+    case 'B':
+        value *= 1000000000ULL;
+        suffix++;
+        break;
+    }
+    if (suffix == text || *suffix != '\0') {
+        return 0;
+    }
+    return value;
+}
+
+/* Reads `name;mean` lines, the format of the challenge's station list. */
+WeatherStation *load_stations(const char *path, size_t *count) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening stations file");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t capacity = 1024;
+    WeatherStation *stations = malloc(sizeof(WeatherStation) * capacity);
+    *count = 0;
+
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        if (buffer[0] == '#') {
+            continue;
+        }
+        char *separator = strchr(buffer, ';');
+        if (separator == NULL ||
+            separator - buffer > MAX_STATION_NAME_LENGTH ||
+            separator == buffer) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            stations = realloc(stations, sizeof(WeatherStation) * capacity);
+        }
+        WeatherStation *station = &stations[(*count)++];
+        memcpy(station->name, buffer, separator - buffer);
+        station->name[separator - buffer] = '\0';
+        station->mean_temperature = atof(separator + 1);
+    }
+
+    fclose(file);
+    if (*count == 0) {
+        fprintf(stderr, "No stations found in %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return stations;
+}
+
+/*
+ * Picks `wanted` stations, cycling through the base set and suffixing the
+ * names once it runs out so any cardinality up to the challenge's 10k can be
+ * produced from the built-in sample.
+ */
+WeatherStation *select_stations(WeatherStation *base, size_t base_count,
+                                size_t wanted, uint64_t *state) {
+    WeatherStation *stations = malloc(sizeof(WeatherStation) * wanted);
+    for (size_t i = 0; i < wanted; i++) {
+        WeatherStation *source = &base[i % base_count];
+        if (i < base_count) {
+            stations[i] = *source;
+            continue;
+        }
+        snprintf(stations[i].name, sizeof(stations[i].name), "%.80s %zu",
+                 source->name, i / base_count);
+        stations[i].mean_temperature =
+            source->mean_temperature + (next_uniform(state) - 0.5) * 10.0;
+    }
+    return stations;
+}
+
+/* Formats tenths of a degree as -?d+.d, returns the length written. */
+int format_tenths(char *out, int tenths) {
+    int length = 0;
+    if (tenths < 0) {
+        out[length++] = '-';
+        tenths = -tenths;
+    }
+    if (tenths >= 100) {
+        out[length++] = '0' + tenths / 100;
+    }
+    out[length++] = '0' + (tenths / 10) % 10;
+    out[length++] = '.';
+    out[length++] = '0' + tenths % 10;
+    return length;
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n\n", program);
+    fprintf(stderr,
+            "Writes name;temperature rows in the challenge format.\n\n"
+            "  -n, --rows N             rows to write, K/M/B suffixes "
+            "allowed\n"
+            "                           (default 1M)\n"
+            "  -s, --stations N         distinct stations (default: the\n"
+            "                           built-in list)\n"
+            "  -f, --stations-file PATH name;mean lines to use instead of "
+            "the\n"
+            "                           built-in list\n"
+            "  -S, --seed N             random seed (default %d)\n"
+            "  -o, --output PATH        output file (default %s)\n"
+            "  -h, --help               show this help\n",
+            DEFAULT_SEED, DEFAULT_OUTPUT_PATH);
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"rows", required_argument, NULL, 'n'},
+        {"stations", required_argument, NULL, 's'},
+        {"stations-file", required_argument, NULL, 'f'},
+        {"seed", required_argument, NULL, 'S'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    unsigned long long rows = DEFAULT_ROWS;
+    unsigned long long wanted_stations = 0;
+    const char *stations_path = NULL;
+    const char *output_path = DEFAULT_OUTPUT_PATH;
+    uint64_t seed = DEFAULT_SEED;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "n:s:f:S:o:h", long_options,
+                                 NULL)) != -1) {
+        switch (option) {
+        case 'n':
+            rows = parse_count(optarg);
+            if (rows == 0) {
+                fprintf(stderr, "Invalid row count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            wanted_stations = parse_count(optarg);
+            if (wanted_stations == 0) {
+                fprintf(stderr, "Invalid station count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            stations_path = optarg;
+            break;
+        case 'S': {
+            char *end;
+            seed = strtoull(optarg, &end, 10);
+            if (end == optarg || *end != '\0') {
+                fprintf(stderr, "Invalid seed: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t state = seed;
+
+    WeatherStation *base = default_stations;
+    size_t base_count = NUMBER_OF_DEFAULT_STATIONS;
+    if (stations_path != NULL) {
+        base = load_stations(stations_path, &base_count);
+    }
+    size_t station_count =
+        wanted_stations == 0 ? base_count : (size_t)wanted_stations;
+    WeatherStation *stations =
+        select_stations(base, base_count, station_count, &state);
+
+    FILE *output = fopen(output_path, "w");
+    if (output == NULL) {
+        perror("Error opening output file");
+        return EXIT_FAILURE;
+    }
+
+    char *buffer = malloc(OUTPUT_BUFFER_SIZE);
+    size_t used = 0;
+
+    for (unsigned long long row = 0; row < rows; row++) {
+        WeatherStation *station =
+            &stations[next_random(&state) % station_count];
+        double temperature = next_gaussian(&state, station->mean_temperature,
+                                           TEMPERATURE_STANDARD_DEVIATION);
+        int tenths = (int)lround(temperature * 10.0);
+        if (tenths > 999) {
+            tenths = 999;
+        } else if (tenths < -999) {
+            tenths = -999;
+        }
+
+        if (used + MAX_LINE_LENGTH > OUTPUT_BUFFER_SIZE) {
+            write_output(output, buffer, used);
+            used = 0;
+        }
+
+        size_t name_length = strlen(station->name);
+        memcpy(buffer + used, station->name, name_length);
+        used += name_length;
+        buffer[used++] = ';';
+        used += format_tenths(buffer + used, tenths);
+        buffer[used++] = '\n';
+    }
+
+    write_output(output, buffer, used);
+    if (fclose(output) != 0) {
+        perror("Error writing output file");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Wrote %llu rows over %zu stations to %s\n", rows,
+            station_count, output_path);
+
+    free(buffer);
+    free(stations);
+    if (base != default_stations) {
+        free(base);
+    }
+    return 0;
+}
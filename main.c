@@ -1,114 +1,663 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #define ENABLE_DEBUG_PRINTS 0
+/* Per-thread hot path counters, build with -DENABLE_COUNTERS=0 to drop them. */
+#ifndef ENABLE_COUNTERS
+#define ENABLE_COUNTERS 1
+#endif
 
-#define TABLE_SIZE 50000000
+/* Comfortably above the ~10k distinct stations, grows if ever exceeded. */
+#define INITIAL_TABLE_CAPACITY 16384
+/* Names up to this many bytes are stored and compared inside the slot. */
+#define INLINE_KEY_SIZE 32
+#define ARENA_BLOCK_SIZE ((size_t)2 * 1024 * 1024)
+/* Temperatures are -99.9..99.9, one histogram bucket per tenth of a degree. */
+#define HISTOGRAM_BUCKETS 1999
+#define HISTOGRAM_OFFSET 999
 #define NUMBER_OF_READER_THREADS 3
-#define MURMUR_SEED 0x9747b28c
-#define NUMBER_OF_WRITER_THREADS_PER_QUEUE 2
-
-#define ALPHABET_START_CHAR 'a'
-#define ALPHABET_END_CHAR 'z'
-#define ALPHABET_START_INT 97
-#define ALPHABET_END_INT 122
-#define ALPHABET_SIZE 26
-#define ALPHABET_SMALL_DRIFT 97
-#define ALPHABET_CAPITAL_DRIFT 32
-#define NUMBER_OF_PARTITIONS (ALPHABET_SIZE + 1)
+#define NUMBER_OF_WRITER_THREADS_PER_SHARD 1
 
 #define MAX_BUFFER_SIZE 1024
-#define DEFAULT_CHUNK_SIZE 200 * 1024 * 1024
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+/* Logical block size O_DIRECT buffers, offsets and lengths are aligned to. */
+#define DIRECT_IO_ALIGNMENT 4096
+#define DEFAULT_CHUNK_SIZE ((size_t)200 * 1024 * 1024)
+#define DEFAULT_MORSEL_SIZE ((size_t)4 * 1024 * 1024)
+#define DEFAULT_INPUT_PATH "measurements.txt"
+#define STDIN_PATH "-"
+#define LINE_BATCH_SIZE 1024
+#define QUEUE_CAPACITY 1024
+#define CACHE_LINE_SIZE 64
+#define COLUMNAR_MAGIC "1BRCCOL1"
+#define SNAPSHOT_MAGIC "1BRCSNP1"
+#define COLUMNAR_CHUNK_ROWS 65536
+/* Columns start on cache lines, so they load as aligned vectors. */
+#define COLUMNAR_ALIGNMENT CACHE_LINE_SIZE
+/* Station ids are uint16_t. */
+#define MAX_COLUMNAR_STATIONS 65536
+#define MAX_COUNTED_THREADS 1024
+/* Events kept per thread by --trace, older ones are overwritten. */
+#define TRACE_RING_SIZE 65536
+
+enum {
+    ENGINE_SEQUENTIAL,
+    ENGINE_LOCKED,
+    ENGINE_PIPELINE,
+    ENGINE_THREAD_LOCAL,
+    ENGINE_STATIC,
+    ENGINE_WORK_STEALING,
+    ENGINE_STREAM,
+    ENGINE_URING,
+    ENGINE_COLUMNAR,
+} engine_type;
+
+char *engine_names[] = {
+    [ENGINE_SEQUENTIAL] = "sequential",
+    [ENGINE_LOCKED] = "locked",
+    [ENGINE_PIPELINE] = "pipeline",
+    [ENGINE_THREAD_LOCAL] = "thread-local",
+    [ENGINE_STATIC] = "static",
+    [ENGINE_WORK_STEALING] = "work-stealing",
+    [ENGINE_STREAM] = "stream",
+    [ENGINE_URING] = "uring",
+    [ENGINE_COLUMNAR] = "columnar",
+};
+
+#define NUMBER_OF_ENGINES (sizeof(engine_names) / sizeof(engine_names[0]))
+
+/* Run settings, filled from the command line by parse_arguments. */
+typedef struct Config {
+    const char *input_path;
+    int engine;
+    /* Worker threads of every engine but sequential and pipeline. */
+    int threads;
+    /*
+     * Pipeline layout: readers route lines by name hash to `shards` queues,
+     * each drained by writers_per_shard writers. 0 shards means one per
+     * worker thread.
+     */
+    int reader_threads;
+    int shards;
+    int writers_per_shard;
+    /* Print the rows every pipeline shard and writer handled. */
+    bool shard_stats;
+    /* Bytes per mapped window, a multiple of the page size. */
+    size_t chunk_size;
+    /* Bytes per unit of work of the work-stealing and buffered engines. */
+    size_t morsel_size;
+    /* Open the input with O_DIRECT for the uring engine. */
+    bool direct_io;
+    /* madvise() advice for every mapping of the input, MADV_NORMAL is none. */
+    int mapping_advice;
+    /* Prefault mappings with MAP_POPULATE. */
+    bool populate;
+    /* Drop consumed pages of long lived mappings with MADV_DONTNEED. */
+    bool release_pages;
+    /* Back hash tables with transparent huge pages. */
+    bool huge_pages;
+    /* Pin every thread to one CPU, grouped by NUMA node. */
+    bool pin_threads;
+    /* Print the per-thread counters, and write them as JSON to a file. */
+    bool print_stats;
+    const char *stats_json_path;
+    /* Write the input as a columnar file for the columnar engine instead. */
+    const char *convert_path;
+    /*
+     * Aggregates of the already parsed part of the input, loaded before and
+     * saved after the run so only appended lines are parsed again.
+     */
+    const char *snapshot_path;
+    /* Seconds between checks for appended lines, 0 to exit after one run. */
+    double follow_interval;
+    /* Keep a histogram per station and print median, p90 and p99. */
+    bool percentiles;
+    /* Chrome trace JSON of every thread's spans, NULL when not tracing. */
+    const char *trace_path;
+    /*
+     * Pipeline writers aggregate into private tables without taking
+     * table_semaphores, the tables are merged after the join.
+     */
+    bool thread_local_tables;
+} Config;
+
+Config config = {
+    .input_path = DEFAULT_INPUT_PATH,
+    .engine = ENGINE_THREAD_LOCAL,
+    .threads = 1,
+    .reader_threads = NUMBER_OF_READER_THREADS,
+    .writers_per_shard = NUMBER_OF_WRITER_THREADS_PER_SHARD,
+    .chunk_size = DEFAULT_CHUNK_SIZE,
+    .morsel_size = DEFAULT_MORSEL_SIZE,
+    .mapping_advice = MADV_NORMAL,
+    .thread_local_tables = true,
+};
+
+typedef struct MappingAdvice {
+    const char *name;
+    int advice;
+} MappingAdvice;
 
-typedef struct Node {
-    void *buffer_start;
-    struct Node *next;
-} Node;
+MappingAdvice mapping_advices[] = {
+    {"normal", MADV_NORMAL},
+    {"sequential", MADV_SEQUENTIAL},
+    {"willneed", MADV_WILLNEED},
+};
+
+#define NUMBER_OF_MAPPING_ADVICES                                              \
+    (sizeof(mapping_advices) / sizeof(mapping_advices[0]))
+
+typedef struct QueueCell {
+    atomic_size_t sequence;
+    void *data;
+} QueueCell;
+
+/*
+ * Bounded multi-producer multi-consumer ring (Dmitry Vyukov's design). Each
+ * cell carries a sequence number that tells producers and consumers whose
+ * turn it is, so the only shared writes are the two position counters, kept
+ * on their own cache lines. The queue is closed once every producer called
+ * queue_producer_done, after which consumers drain it and get NULL.
+ */
 typedef struct Queue {
     u_int8_t id;
-    Node *front;
-    Node *rear;
+    QueueCell *cells;
+    size_t mask;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_position;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_position;
+    _Alignas(CACHE_LINE_SIZE) atomic_int active_producers;
+    atomic_bool closed;
 } Queue;
 
-Queue *file_queues[NUMBER_OF_PARTITIONS];
+Queue **file_queues;
+
+/*
+ * A window of the file mapped by a reader. Every batch that points into the
+ * window holds a reference on it, the last consumer to finish unmaps it.
+ */
+typedef struct MappedWindow {
+    void *memory;
+    size_t mapped_length;
+    atomic_int consumers;
+} MappedWindow;
+
+/* A single line inside a mapped window, without the trailing newline. */
+typedef struct LineView {
+    const char *start;
+    u_int32_t length;
+    /* Filled in by pipeline readers, which hash the name to route it. */
+    u_int32_t name_length;
+    uint32_t hash;
+} LineView;
+
+typedef struct LineBatch {
+    MappedWindow *window;
+    u_int32_t count;
+    LineView lines[LINE_BATCH_SIZE];
+} LineBatch;
 
 typedef struct Station {
-    char name[50];
-    float average_temp;
-    float min_temp;
-    float max_temp;
-    float median_temp;
-    unsigned int count;
+    /* Tenths of a degree, the mean is only computed when printing. */
+    int64_t sum_temp;
+    int32_t min_temp;
+    int32_t max_temp;
+    /*
+     * Readings per tenth of a degree with --percentiles, NULL otherwise.
+     * Lives in the owning table's histogram arena; 32-bit buckets are enough
+     * for 4G readings of a single station.
+     */
+    uint32_t *histogram;
+    uint64_t count;
 } Station;
 
+/*
+ * Open addressing with linear probing. The aggregates live inline in the
+ * slots, and the capacity is a power of two so the probe index is a mask of
+ * the hash.
+ */
 typedef struct Entry {
-    char *key;
-    Station *value;
-    struct Entry *next;
+    /* Short names, zero padded so they compare as two vectors. */
+    _Alignas(16) char inline_key[INLINE_KEY_SIZE];
+    /* Names longer than INLINE_KEY_SIZE, up to the challenge's 100 bytes,
+     * live in the table's arena. */
+    char *long_key;
+    uint32_t hash;
+    /* 0 marks an empty slot, station names are never empty. */
+    uint32_t key_length;
+    Station value;
 } Entry;
 
+/*
+ * Bump allocator owning the keys of one table, so a new station costs a
+ * pointer bump instead of a malloc and teardown frees a few blocks instead
+ * of walking every slot.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *blocks;
+    char *cursor;
+    char *limit;
+} Arena;
+
 typedef struct HashTable {
-    Entry **entries;
+    Entry *entries;
+    size_t capacity;
+    size_t count;
+    Arena keys;
+    /* Only histograms, so every one of them stays 4-byte aligned. */
+    Arena histograms;
 } HashTable;
 
-HashTable *tables[NUMBER_OF_PARTITIONS];
+HashTable **tables;
 
 typedef struct reader_thread_data {
     int thread_id;
     FILE *file;
     size_t file_size;
-    int *file_read_count;
-    int *finished_reader_threads;
-    int *file_mmap_offset;
+    size_t *file_mmap_offset;
 } reader_thread_data;
 
 typedef struct writer_thread_data {
     int thread_id;
-    char queue_letter;
+    int shard;
     HashTable *table;
-    int *finished_reader_threads;
+    /* Load statistics, only written by the writer itself. */
+    uint64_t rows;
+    uint64_t batches;
 } writer_thread_data;
 
-pthread_mutex_t file_semaphore = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t read_queue_exit_count_semaphore = PTHREAD_MUTEX_INITIALIZER;
+typedef struct range_thread_data {
+    int thread_id;
+    const char *start;
+    const char *end;
+    HashTable *table;
+} range_thread_data;
+
+/*
+ * Work-stealing deque over a contiguous run of morsel indices. Nothing is
+ * pushed once workers start, so the indices themselves are the deque
+ * contents: the owner pops from the bottom, thieves take from the top
+ * (Chase-Lev, without the growable array).
+ */
+typedef struct WorkDeque {
+    _Alignas(CACHE_LINE_SIZE) atomic_long top;
+    _Alignas(CACHE_LINE_SIZE) atomic_long bottom;
+} WorkDeque;
+
+typedef struct steal_thread_data {
+    int thread_id;
+    int number_of_threads;
+    WorkDeque *deques;
+    const char **morsel_boundaries;
+    HashTable *table;
+} steal_thread_data;
+
+/*
+ * A read buffer of the stream and uring engines. Reads land at `data`, and
+ * the block in front of it receives the partial line carried over from the
+ * previous buffer, so complete lines always run from `start` to `end` in
+ * one piece.
+ */
+typedef struct StreamBuffer {
+    char *memory;
+    char *data;
+    const char *start;
+    const char *end;
+    /* Position in the file, only used by the uring reader. */
+    size_t sequence;
+    size_t offset;
+    size_t length;
+    /* Target of an unregistered uring read, alive until it completes. */
+    struct iovec vector;
+} StreamBuffer;
+
+/* Partial line left at the end of the last buffer handed to the workers. */
+typedef struct StreamCarry {
+    char bytes[MAX_BUFFER_SIZE];
+    size_t length;
+} StreamCarry;
+
+/* The mapped submission and completion rings of an io_uring instance. */
+typedef struct Uring {
+    int fd;
+    bool fixed_buffers;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+typedef struct stream_thread_data {
+    int thread_id;
+    int fd;
+    /* Page cache descriptor for the rare short read under O_DIRECT. */
+    int buffered_fd;
+    size_t file_size;
+    Uring *ring;
+    StreamBuffer *buffers;
+    int number_of_buffers;
+    Queue *filled_buffers;
+    Queue *free_buffers;
+    HashTable *table;
+} stream_thread_data;
+
+typedef struct worker_thread_data {
+    int thread_id;
+    FILE *file;
+    size_t file_size;
+    size_t *file_mmap_offset;
+    HashTable *table;
+    pthread_mutex_t *table_semaphore;
+} worker_thread_data;
+
+/*
+ * What one thread did, on cache lines of its own so counting never bounces
+ * a line between cores. Threads claim a slot with register_counters, the
+ * report sums every claimed slot after the join.
+ */
+typedef struct ThreadCounters {
+    _Alignas(CACHE_LINE_SIZE) const char *role;
+    int thread_id;
+    uint64_t rows;
+    uint64_t bytes;
+    uint64_t chunks;
+    /* Blocked on a contended mutex or a full or empty queue. */
+    uint64_t wait_ns;
+    uint64_t probes;
+    /* Probed slots holding another station. */
+    uint64_t collisions;
+    uint64_t inserts;
+} ThreadCounters;
+
+/* Slot 0 belongs to the main thread, which merges the tables. */
+ThreadCounters thread_counters[MAX_COUNTED_THREADS] = {{.role = "main"}};
+atomic_int counted_threads = 1;
+_Thread_local ThreadCounters *counters = &thread_counters[0];
+
+#if ENABLE_COUNTERS
+#define COUNT(counter, amount) (counters->counter += (amount))
+#else
+#define COUNT(counter, amount) ((void)(amount))
+#endif
+
+enum {
+    TRACE_MMAP,
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_ROUTE,
+    TRACE_ENQUEUE,
+    TRACE_DEQUEUE,
+    TRACE_LOCK,
+    TRACE_MERGE,
+} trace_event_type;
+
+char *trace_event_names[] = {
+    [TRACE_MMAP] = "mmap",
+    [TRACE_READ] = "read",
+    [TRACE_PARSE] = "parse",
+    [TRACE_ROUTE] = "route",
+    [TRACE_ENQUEUE] = "enqueue",
+    [TRACE_DEQUEUE] = "dequeue",
+    [TRACE_LOCK] = "lock",
+    [TRACE_MERGE] = "merge",
+};
+
+typedef struct TraceEvent {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int type;
+} TraceEvent;
+
+/*
+ * Spans recorded by one thread. Only the owner writes, so recording is a
+ * clock read and a store; the ring keeps the last TRACE_RING_SIZE spans.
+ */
+typedef struct TraceRing {
+    uint64_t recorded;
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+/* Indexed like thread_counters, NULL for threads that record nothing. */
+TraceRing *trace_rings[MAX_COUNTED_THREADS];
+_Thread_local TraceRing *trace_ring;
+uint64_t trace_origin_ns;
+
+static inline uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Clock for waits, 0 when neither counters nor a trace want it. */
+static inline uint64_t wait_clock() {
+    return ENABLE_COUNTERS || trace_ring != NULL ? now_ns() : 0;
+}
+
+static inline void trace_span(int type, uint64_t start_ns, uint64_t end_ns) {
+    if (trace_ring == NULL) {
+        return;
+    }
+    TraceEvent *event =
+        &trace_ring->events[trace_ring->recorded++ % TRACE_RING_SIZE];
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    event->type = type;
+}
+
+/* Start of a span, 0 when this thread does not trace. */
+static inline uint64_t trace_begin() {
+    return trace_ring == NULL ? 0 : now_ns();
+}
+
+static inline void trace_end(int type, uint64_t start_ns) {
+    if (trace_ring != NULL) {
+        trace_span(type, start_ns, now_ns());
+    }
+}
+
+/*
+ * Threads past MAX_COUNTED_THREADS count into a private slot that is left
+ * out of the report, sharing a slot would race on its plain increments.
+ */
+void register_counters(const char *role, int thread_id) {
+    static _Thread_local ThreadCounters unreported;
+    int slot = atomic_fetch_add(&counted_threads, 1);
+    if (slot >= MAX_COUNTED_THREADS) {
+        counters = &unreported;
+        return;
+    }
+    counters = &thread_counters[slot];
+    counters->role = role;
+    counters->thread_id = thread_id;
+
+    if (config.trace_path != NULL) {
+        trace_rings[slot] = calloc(1, sizeof(TraceRing));
+        trace_ring = trace_rings[slot];
+    }
+}
+
+/*
+ * Hands the worker slots out again once their threads are gone, so runs
+ * repeated by --follow do not use up MAX_COUNTED_THREADS.
+ */
+void reset_counters() {
+    int slots = atomic_load(&counted_threads);
+    if (slots > MAX_COUNTED_THREADS) {
+        slots = MAX_COUNTED_THREADS;
+    }
+    memset(&thread_counters[1], 0, sizeof(ThreadCounters) * (slots - 1));
+    atomic_store(&counted_threads, 1);
+}
+
+/* Only a lock that is already taken pays for the clock reads. */
+static inline void lock_counted(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+    uint64_t started = wait_clock();
+    pthread_mutex_lock(mutex);
+    uint64_t acquired = wait_clock();
+    COUNT(wait_ns, acquired - started);
+    trace_span(TRACE_LOCK, started, acquired);
+}
+
+/*
+ * Saved by --snapshot after the header: per station a uint16_t name length,
+ * the name, sum, min, max and count, and with histograms its buckets.
+ */
+typedef struct SnapshotHeader {
+    char magic[8];
+    /* The input up to `offset`, which ends a line, is in the aggregates. */
+    uint64_t offset;
+    /* File size, inode and device the offset refers to. */
+    uint64_t size;
+    uint64_t inode;
+    uint64_t device;
+    uint32_t station_count;
+    uint32_t has_histograms;
+} SnapshotHeader;
+
+/* Aggregates of the input up to `offset`, kept across --follow refreshes. */
+typedef struct Snapshot {
+    HashTable *table;
+    size_t offset;
+    size_t size;
+    uint64_t inode;
+    uint64_t device;
+} Snapshot;
+
+/*
+ * Columnar file written by --convert and read by the columnar engine:
+ * header, station dictionary, chunk data, chunk directory. The dictionary
+ * holds every name as a uint16_t length and its bytes, in name order, and
+ * a station's id is its position there. Every chunk stores a uint16_t id
+ * column followed by an int16_t tenths column. All integers are host-order.
+ */
+typedef struct ColumnarHeader {
+    char magic[8];
+    uint32_t station_count;
+    uint32_t chunk_count;
+    uint64_t row_count;
+    uint64_t dictionary_offset;
+    uint64_t directory_offset;
+} ColumnarHeader;
+
+typedef struct ColumnarChunk {
+    /* Start of the id column; the tenths column follows it, aligned. */
+    uint64_t offset;
+    uint32_t rows;
+    /* Range of the chunk's readings, lets range queries skip chunks. */
+    int16_t min_tenths;
+    int16_t max_tenths;
+} ColumnarChunk;
+
+/* Per station aggregates of one columnar worker, indexed by station id. */
+typedef struct ColumnarTotals {
+    int64_t *sums;
+    uint64_t *counts;
+    int16_t *mins;
+    int16_t *maxes;
+    /* HISTOGRAM_BUCKETS per station with --percentiles, NULL otherwise. */
+    uint32_t *histograms;
+} ColumnarTotals;
+
+typedef struct columnar_thread_data {
+    int thread_id;
+    const char *memory;
+    const ColumnarChunk *chunks;
+    uint32_t chunk_count;
+    uint32_t station_count;
+    atomic_uint *next_chunk;
+    ColumnarTotals totals;
+} columnar_thread_data;
+
 pthread_mutex_t file_mmap_offset_semaphore = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t table_semaphores[NUMBER_OF_PARTITIONS];
-pthread_mutex_t file_queue_semaphores[NUMBER_OF_PARTITIONS];
+pthread_mutex_t *table_semaphores;
 
 void initialize_semaphores() {
-    for (int i = 0; i < NUMBER_OF_PARTITIONS; i++) {
+    table_semaphores = malloc(sizeof(pthread_mutex_t) * config.shards);
+    for (int i = 0; i < config.shards; i++) {
         pthread_mutex_init(&table_semaphores[i], NULL);
-        pthread_mutex_init(&file_queue_semaphores[i], NULL);
     }
 }
 
 void destroy_semaphores() {
-    for (int i = 0; i < NUMBER_OF_PARTITIONS; i++) {
+    for (int i = 0; i < config.shards; i++) {
         pthread_mutex_destroy(&table_semaphores[i]);
-        pthread_mutex_destroy(&file_queue_semaphores[i]);
     }
+    free(table_semaphores);
+}
+
+/* `capacity` must be a power of two. */
+Queue *create_queue(int id, size_t capacity, int producers) {
+    Queue *q = aligned_alloc(CACHE_LINE_SIZE, sizeof(Queue));
+    q->id = id;
+    q->cells = malloc(sizeof(QueueCell) * capacity);
+    q->mask = capacity - 1;
+    for (size_t c = 0; c < capacity; c++) {
+        atomic_init(&q->cells[c].sequence, c);
+    }
+    atomic_init(&q->enqueue_position, 0);
+    atomic_init(&q->dequeue_position, 0);
+    atomic_init(&q->active_producers, producers);
+    atomic_init(&q->closed, false);
+    return q;
+}
+
+void free_queue(Queue *q) {
+    free(q->cells);
+    free(q);
 }
 
 void initialize_queues() {
-    for (int i = 0; i < NUMBER_OF_PARTITIONS; i++) {
-        file_queues[i] = malloc(sizeof(Queue));
-        file_queues[i]->id = i;
-        file_queues[i]->front = NULL;
-        file_queues[i]->rear = NULL;
+    file_queues = malloc(sizeof(Queue *) * config.shards);
+    for (int i = 0; i < config.shards; i++) {
+        file_queues[i] = create_queue(i, QUEUE_CAPACITY, config.reader_threads);
     }
 }
 
 void destroy_queues() {
-    for (int i = 0; i < NUMBER_OF_PARTITIONS; i++) {
-        free(file_queues[i]);
+    for (int i = 0; i < config.shards; i++) {
+        free_queue(file_queues[i]);
     }
+    free(file_queues);
 }
 
 enum {
@@ -148,329 +697,2544 @@ char *get_semaphore_name(int semaphore_type) {
     }
 }
 
-void enqueue(Queue *q, void *buffer_start) {
-    Node *newNode = (Node *)malloc(sizeof(Node));
-    newNode->buffer_start = buffer_start;
-    newNode->next = NULL;
-    if (q->rear == NULL) {
-        q->front = q->rear = newNode;
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+/* Spin briefly, then yield, then sleep while the other side catches up. */
+void backoff(unsigned int *attempt) {
+    if (*attempt < 64) {
+        cpu_relax();
+    } else if (*attempt < 128) {
+        sched_yield();
     } else {
-        q->rear->next = newNode;
-        q->rear = newNode;
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = 50000};
+        nanosleep(&pause, NULL);
     }
+    *attempt += 1;
 }
-void *dequeue(Queue *q) {
-    if (q->front == NULL) {
-        return false;
-    }
-    Node *temp = q->front;
 
-    q->front = q->front->next;
-    if (q->front == NULL)
-        q->rear = NULL;
+bool try_enqueue(Queue *q, void *data) {
+    size_t position =
+        atomic_load_explicit(&q->enqueue_position, memory_order_relaxed);
+    for (;;) {
+        QueueCell *cell = &q->cells[position & q->mask];
+        size_t sequence =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
 
-    return temp->buffer_start;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->enqueue_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = data;
+                atomic_store_explicit(&cell->sequence, position + 1,
+                                      memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = atomic_load_explicit(&q->enqueue_position,
+                                            memory_order_relaxed);
+        }
+    }
 }
 
-static inline uint32_t murmur_32_scramble(uint32_t k) {
-    k *= 0xcc9e2d51;
-    k = (k << 15) | (k >> 17);
-    k *= 0x1b873593;
-    return k;
-}
+void *try_dequeue(Queue *q) {
+    size_t position =
+        atomic_load_explicit(&q->dequeue_position, memory_order_relaxed);
+    for (;;) {
+        QueueCell *cell = &q->cells[position & q->mask];
+        size_t sequence =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
 
-uint32_t murmur3_32(const uint8_t *key, size_t len, uint32_t seed) {
-    uint32_t h = seed;
-    uint32_t k;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->dequeue_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                void *data = cell->data;
+                atomic_store_explicit(&cell->sequence, position + q->mask + 1,
+                                      memory_order_release);
+                return data;
+            }
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = atomic_load_explicit(&q->dequeue_position,
+                                            memory_order_relaxed);
+        }
+    }
+}
 
-    for (size_t i = len >> 2; i; i--) {
-        memcpy(&k, key, sizeof(uint32_t));
-        key += sizeof(uint32_t);
-        h ^= murmur_32_scramble(k);
-        h = (h << 13) | (h >> 19);
-        h = h * 5 + 0xe6546b64;
+/* Blocks with backoff while the ring is full. */
+void enqueue(Queue *q, void *data) {
+    if (try_enqueue(q, data)) {
+        return;
     }
+    uint64_t started = wait_clock();
+    unsigned int attempt = 0;
+    do {
+        backoff(&attempt);
+    } while (!try_enqueue(q, data));
+    uint64_t enqueued = wait_clock();
+    COUNT(wait_ns, enqueued - started);
+    trace_span(TRACE_ENQUEUE, started, enqueued);
+}
 
-    k = 0;
-    for (size_t i = len & 3; i; i--) {
-        k <<= 8;
-        k |= key[i - 1];
+/* Blocks with backoff while the ring is empty, NULL once closed and drained. */
+void *dequeue(Queue *q) {
+    void *data = try_dequeue(q);
+    if (data != NULL) {
+        return data;
+    }
+    uint64_t started = wait_clock();
+    unsigned int attempt = 0;
+    for (;;) {
+        if (atomic_load(&q->closed)) {
+            /* Everything enqueued before the close is visible now. */
+            data = try_dequeue(q);
+            break;
+        }
+        backoff(&attempt);
+        data = try_dequeue(q);
+        if (data != NULL) {
+            break;
+        }
     }
+    uint64_t dequeued = wait_clock();
+    COUNT(wait_ns, dequeued - started);
+    trace_span(TRACE_DEQUEUE, started, dequeued);
+    return data;
+}
 
-    h ^= murmur_32_scramble(k);
-    h ^= len;
-    h ^= h >> 16;
-    h *= 0x85ebca6b;
-    h ^= h >> 13;
-    h *= 0xc2b2ae35;
-    h ^= h >> 16;
-    return h;
+void queue_producer_done(Queue *q) {
+    if (atomic_fetch_sub(&q->active_producers, 1) == 1) {
+        atomic_store(&q->closed, true);
+    }
 }
-unsigned int hash(const char *key) {
-    return murmur3_32((const uint8_t *)key, strlen(key), MURMUR_SEED) %
-           TABLE_SIZE;
+
+/*
+ * Station names are hashed eight bytes at a time: every word is folded into
+ * a 64-bit state with a multiply, the last partial word is masked to the
+ * name's bytes. scan_name produces the same value while it looks for the
+ * ';', so the name is only read once on the hot path.
+ */
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+#define SWAR_SEMICOLONS (SWAR_ONES * ';')
+#define HASH_SEED 0x9747b28cULL
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t load_word(const char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
 }
 
-HashTable *create_table() {
-    HashTable *table = malloc(sizeof(HashTable));
-    table->entries = calloc(TABLE_SIZE, sizeof(Entry *));
-    return table;
+/* Keeps the first `bytes` bytes of a little-endian word, 0 < bytes < 8. */
+static inline uint64_t mask_word(uint64_t word, size_t bytes) {
+    return word & ((1ULL << (bytes * 8)) - 1);
 }
-void free_table(HashTable *table) {
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        Entry *entry = table->entries[i];
-        while (entry != NULL) {
-            Entry *next = entry->next;
-            free(entry->key);
-            free(entry);
-            entry = next;
-        }
-    }
-    free(table->entries);
-    free(table);
+static inline uint64_t hash_word(uint64_t state, uint64_t word) {
+    state = (state ^ word) * HASH_MULTIPLIER;
+    return state ^ (state >> 29);
 }
 
-void ht_set(HashTable *table, const char *key, Station *value) {
-    unsigned int index = hash(key);
-    Entry *entry = table->entries[index];
+static inline uint32_t hash_finish(uint64_t state) {
+    state ^= state >> 32;
+    state *= HASH_MULTIPLIER;
+    return (uint32_t)(state >> 32);
+}
 
-    for (Entry *e = entry; e != NULL; e = e->next) {
-        if (strcmp(e->key, key) == 0) {
-            e->value = value;
-            return;
-        }
+uint32_t hash(const char *key, size_t length) {
+    uint64_t state = HASH_SEED;
+    size_t offset = 0;
+    for (; offset + 8 <= length; offset += 8) {
+        state = hash_word(state, load_word(key + offset));
+    }
+    if (offset < length) {
+        uint64_t word = 0;
+        memcpy(&word, key + offset, length - offset);
+        state = hash_word(state, word);
     }
+    return hash_finish(state);
+}
 
-    Entry *new_entry = malloc(sizeof(Entry));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    new_entry->next = entry;
-    table->entries[index] = new_entry;
+/* Bit 7 of every byte of `word` that equals ';', lower bytes exact. */
+static inline uint64_t find_semicolons(uint64_t word) {
+    uint64_t x = word ^ SWAR_SEMICOLONS;
+    return (x - SWAR_ONES) & ~x & SWAR_HIGHS;
 }
-Station *ht_get(HashTable *table, const char *key) {
-    unsigned int index = hash(key);
-    Entry *entry = table->entries[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry->value;
+
+/*
+ * Finds the ';' in [start, end) eight bytes at a time and hashes the name in
+ * front of it from the same words. Loads never cross `end`, the last few
+ * bytes of a line are copied into a zeroed word instead. Returns NULL when
+ * there is no ';'.
+ */
+const char *scan_name(const char *start, const char *end,
+                      uint32_t *name_hash) {
+    uint64_t state = HASH_SEED;
+    const char *p = start;
+
+    for (; end - p >= 8; p += 8) {
+        uint64_t word = load_word(p);
+        uint64_t found = find_semicolons(word);
+        if (found != 0) {
+            size_t index = __builtin_ctzll(found) >> 3;
+            if (index > 0) {
+                state = hash_word(state, mask_word(word, index));
+            }
+            *name_hash = hash_finish(state);
+            return p + index;
         }
-        entry = entry->next;
+        state = hash_word(state, word);
     }
-    return NULL;
-}
 
-void initialize_hash_tables() {
-    for (int i = 0; i < NUMBER_OF_PARTITIONS; i++) {
-        tables[i] = create_table();
+    uint64_t word = 0;
+    memcpy(&word, p, end - p);
+    uint64_t found = find_semicolons(word);
+    if (found == 0) {
+        return NULL;
     }
+    size_t index = __builtin_ctzll(found) >> 3;
+    if (index > 0) {
+        state = hash_word(state, mask_word(word, index));
+    }
+    *name_hash = hash_finish(state);
+    return p + index;
 }
 
-float calculate_average(int count, float average, float new_value) {
-    return ((average * count) + new_value) / (count + 1);
+size_t round_up_to_huge_page(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
 }
-float return_max(float a, float b) { return (a > b) ? a : b; }
-float return_min(float a, float b) { return (a < b) ? a : b; }
 
-int index_by_alphabet(char letter) {
-    int letter_int = (int)letter;
-    if (letter_int >= ALPHABET_START_INT && letter_int <= ALPHABET_END_INT) {
-        return letter_int - ALPHABET_START_INT;
+/*
+ * Zeroed memory for large, long lived allocations. With --huge-pages it comes
+ * straight from mmap, trimmed to a 2 MB boundary and advised for transparent
+ * huge pages, so random probes hit far fewer TLB entries.
+ */
+void *allocate_large(size_t size) {
+    if (!config.huge_pages) {
+        return calloc(1, size);
+    }
+
+    size_t rounded = round_up_to_huge_page(size);
+    char *memory = mmap(NULL, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap failed, killing process");
+        exit(EXIT_FAILURE);
     }
-    if (letter_int >= (ALPHABET_START_INT - ALPHABET_CAPITAL_DRIFT) &&
-        letter_int <= (ALPHABET_END_INT - ALPHABET_CAPITAL_DRIFT)) {
-        return letter_int - (ALPHABET_START_INT - ALPHABET_CAPITAL_DRIFT);
+
+    char *aligned = (char *)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) &
+                             ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > memory) {
+        munmap(memory, aligned - memory);
     }
-    return ALPHABET_SIZE;
+    munmap(aligned + rounded, memory + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, rounded, MADV_HUGEPAGE);
+    return aligned;
 }
 
-void message(const char *message, int thread_type, int thread_id,
-             int semaphore_type) {
-    if (ENABLE_DEBUG_PRINTS == 0) {
+void free_large(void *memory, size_t size) {
+    if (!config.huge_pages) {
+        free(memory);
         return;
     }
-    printf("%s\n", message);
+    munmap(memory, round_up_to_huge_page(size));
 }
 
-size_t get_file_size(FILE *file) {
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    return size;
+void *arena_allocate(Arena *arena, size_t size) {
+    if ((size_t)(arena->limit - arena->cursor) < size) {
+        size_t block_size = sizeof(ArenaBlock) + size > ARENA_BLOCK_SIZE
+                                ? sizeof(ArenaBlock) + size
+                                : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = allocate_large(block_size);
+        block->next = arena->blocks;
+        block->size = block_size;
+        arena->blocks = block;
+        arena->cursor = (char *)(block + 1);
+        arena->limit = (char *)block + block_size;
+    }
+    void *memory = arena->cursor;
+    arena->cursor += size;
+    return memory;
 }
 
-void *process_file_data(void *threadarg) {
-    reader_thread_data *my_data = (reader_thread_data *)threadarg;
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free_large(block, block->size);
+        block = next;
+    }
+}
 
-    for (;;) {
-        char buffer[1024];
+/* Arena memory starts out zeroed, so a fresh histogram counts nothing. */
+uint32_t *allocate_histogram(HashTable *table) {
+    return arena_allocate(&table->histograms,
+                          HISTOGRAM_BUCKETS * sizeof(uint32_t));
+}
 
-        pthread_mutex_lock(&file_semaphore);
-        pthread_mutex_lock(&file_mmap_offset_semaphore);
+HashTable *create_table() {
+    HashTable *table = malloc(sizeof(HashTable));
+    table->entries = allocate_large(INITIAL_TABLE_CAPACITY * sizeof(Entry));
+    table->capacity = INITIAL_TABLE_CAPACITY;
+    table->count = 0;
+    table->keys = (Arena){0};
+    table->histograms = (Arena){0};
+    return table;
+}
 
-        size_t bytes_to_map = DEFAULT_CHUNK_SIZE;
+void free_table(HashTable *table) {
+    arena_free(&table->keys);
+    arena_free(&table->histograms);
+    free_large(table->entries, table->capacity * sizeof(Entry));
+    free(table);
+}
 
-        size_t offset = *(my_data->file_mmap_offset);
-        if (offset >= my_data->file_size) {
+static inline const char *entry_key(const Entry *entry) {
+    return entry->key_length <= INLINE_KEY_SIZE ? entry->inline_key
+                                                : entry->long_key;
+}
 
-            pthread_mutex_unlock(&file_mmap_offset_semaphore);
-            pthread_mutex_unlock(&file_semaphore);
+#if defined(__SSE2__)
+static const int8_t key_positions[INLINE_KEY_SIZE]
+    __attribute__((aligned(16))) = {
+        0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15,
+        16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+};
+#endif
 
-            pthread_mutex_lock(&read_queue_exit_count_semaphore);
-            *my_data->finished_reader_threads += 1;
-            pthread_mutex_unlock(&read_queue_exit_count_semaphore);
+/*
+ * Compares a name of at most INLINE_KEY_SIZE bytes against a zero padded
+ * slot key. The input bytes past `key_length` are masked off, so this is two
+ * masked vector compares and no branch; `key` needs INLINE_KEY_SIZE readable
+ * bytes.
+ */
+static inline bool inline_key_equals(const char *stored, const char *key,
+                                     size_t key_length) {
+#if defined(__SSE2__)
+    __m128i length = _mm_set1_epi8((char)key_length);
+    __m128i low_mask = _mm_cmpgt_epi8(
+        length, _mm_load_si128((const __m128i *)key_positions));
+    __m128i high_mask = _mm_cmpgt_epi8(
+        length, _mm_load_si128((const __m128i *)(key_positions + 16)));
+    __m128i low =
+        _mm_and_si128(_mm_loadu_si128((const __m128i *)key), low_mask);
+    __m128i high = _mm_and_si128(
+        _mm_loadu_si128((const __m128i *)(key + 16)), high_mask);
+    __m128i equal = _mm_and_si128(
+        _mm_cmpeq_epi8(low, _mm_load_si128((const __m128i *)stored)),
+        _mm_cmpeq_epi8(high, _mm_load_si128((const __m128i *)(stored + 16))));
+    return _mm_movemask_epi8(equal) == 0xFFFF;
+#else
+    return memcmp(stored, key, key_length) == 0;
+#endif
+}
 
-            pthread_exit(NULL);
+/* Long names: the first 16 bytes a word at a time, then the rest. */
+static inline bool key_equals(const char *stored, const char *key,
+                              size_t key_length) {
+    size_t offset = 0;
+    for (; offset < 16 && offset + 8 <= key_length; offset += 8) {
+        if (load_word(stored + offset) != load_word(key + offset)) {
+            return false;
         }
+    }
+    return memcmp(stored + offset, key + offset, key_length - offset) == 0;
+}
 
-        if (offset + bytes_to_map > my_data->file_size) {
-            bytes_to_map = my_data->file_size - offset;
+/* Finds the slot holding `key`, or the empty slot where it belongs. */
+Entry *ht_find_slot(HashTable *table, const char *key, size_t key_length,
+                    uint32_t key_hash) {
+    size_t mask = table->capacity - 1;
+    size_t index = key_hash & mask;
+    for (;;) {
+        COUNT(probes, 1);
+        Entry *entry = &table->entries[index];
+        if (entry->key_length == 0) {
+            return entry;
         }
-        void *file_memory = mmap(NULL, bytes_to_map, PROT_READ, MAP_PRIVATE,
-                                 fileno(my_data->file), offset);
+        if (entry->hash == key_hash && entry->key_length == key_length &&
+            (key_length <= INLINE_KEY_SIZE
+                 ? inline_key_equals(entry->inline_key, key, key_length)
+                 : key_equals(entry->long_key, key, key_length))) {
+            return entry;
+        }
+        COUNT(collisions, 1);
+        index = (index + 1) & mask;
+    }
+}
 
-        if (file_memory == MAP_FAILED) {
-            perror("mmap failed, killing process");
-            exit(EXIT_FAILURE);
+void ht_grow(HashTable *table) {
+    Entry *old_entries = table->entries;
+    size_t old_capacity = table->capacity;
+
+    table->capacity = old_capacity * 2;
+    table->entries = allocate_large(table->capacity * sizeof(Entry));
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].key_length == 0) {
+            continue;
+        }
+        size_t index = old_entries[i].hash & mask;
+        while (table->entries[index].key_length != 0) {
+            index = (index + 1) & mask;
         }
+        table->entries[index] = old_entries[i];
+    }
+    free_large(old_entries, old_capacity * sizeof(Entry));
+}
 
-        *my_data->file_read_count += 1;
-        *(my_data->file_mmap_offset) += DEFAULT_CHUNK_SIZE;
+/*
+ * `key_hash` is hash(key, key_length), usually computed by scan_name. Names
+ * of at most INLINE_KEY_SIZE bytes need that many readable bytes at `key`,
+ * the same holds for ht_get.
+ */
+void ht_set(HashTable *table, const char *key, size_t key_length,
+            uint32_t key_hash, Station *value) {
+    Entry *entry = ht_find_slot(table, key, key_length, key_hash);
 
-        pthread_mutex_lock(&file_mmap_offset_semaphore);
-        pthread_mutex_unlock(&file_semaphore);
+    if (entry->key_length != 0) {
+        entry->value = *value;
+        return;
+    }
 
-        int queue_index = index_by_alphabet(buffer[0]);
+    if ((table->count + 1) * 2 > table->capacity) {
+        ht_grow(table);
+        entry = ht_find_slot(table, key, key_length, key_hash);
+    }
 
-        pthread_mutex_lock(&file_queue_semaphores[queue_index]);
-        enqueue(file_queues[queue_index], buffer);
-        pthread_mutex_unlock(&file_queue_semaphores[queue_index]);
+    /* Fresh slots are zeroed, which pads short names. */
+    if (key_length <= INLINE_KEY_SIZE) {
+        memcpy(entry->inline_key, key, key_length);
+    } else {
+        entry->long_key = arena_allocate(&table->keys, key_length);
+        memcpy(entry->long_key, key, key_length);
     }
-    pthread_exit(NULL);
+    entry->hash = key_hash;
+    entry->key_length = key_length;
+    entry->value = *value;
+    table->count++;
+    COUNT(inserts, 1);
 }
 
-void *insert_data_into_table(void *arg) {
+Station *ht_get(HashTable *table, const char *key, size_t key_length,
+                uint32_t key_hash) {
+    Entry *entry = ht_find_slot(table, key, key_length, key_hash);
+    return entry->key_length == 0 ? NULL : &entry->value;
+}
 
-    writer_thread_data *my_data = (writer_thread_data *)arg;
+void initialize_hash_tables() {
+    tables = malloc(sizeof(HashTable *) * config.shards);
+    for (int i = 0; i < config.shards; i++) {
+        tables[i] = create_table();
+    }
+}
 
-    for (;;) {
-        char buffer[1024];
+/*
+ * Rounds sum / count half up (floor(x + 0.5)), the rounding the challenge
+ * reference output uses for the mean.
+ */
+int64_t round_mean(int64_t sum, uint64_t count) {
+    int64_t numerator = 2 * sum + (int64_t)count;
+    int64_t denominator = 2 * (int64_t)count;
+    int64_t quotient = numerator / denominator;
+    if (numerator % denominator != 0 && numerator < 0) {
+        quotient--;
+    }
+    return quotient;
+}
+
+/* Writes tenths of a degree as -?d+.d, returns the number of bytes. */
+size_t format_tenths(char *out, int64_t tenths) {
+    size_t length = 0;
+    if (tenths < 0) {
+        out[length++] = '-';
+        tenths = -tenths;
+    }
+    if (tenths >= 100) {
+        out[length++] = '0' + tenths / 100;
+    }
+    out[length++] = '0' + (tenths / 10) % 10;
+    out[length++] = '.';
+    out[length++] = '0' + tenths % 10;
+    return length;
+}
 
-        pthread_mutex_lock(
-            &file_queue_semaphores[index_by_alphabet(my_data->queue_letter)]);
+/*
+ * Nearest-rank median, p90 and p99 in one walk over the buckets: the
+ * smallest temperature with at least ceil(p * count) readings at or below
+ * it, so the values are exact readings rather than interpolations.
+ */
+void compute_percentiles(const Station *s, int64_t percentiles[3]) {
+    static const uint64_t percents[3] = {50, 90, 99};
+    uint64_t seen = 0;
+    int next = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS && next < 3; bucket++) {
+        seen += s->histogram[bucket];
+        while (next < 3 && seen * 100 >= s->count * percents[next]) {
+            percentiles[next++] = bucket - HISTOGRAM_OFFSET;
+        }
+    }
+}
 
-        void *buffer_start =
-            dequeue(file_queues[index_by_alphabet(my_data->queue_letter)]);
-        pthread_mutex_unlock(
-            &file_queue_semaphores[index_by_alphabet(my_data->queue_letter)]);
+/* Orders by the raw UTF-8 bytes of the name, i.e. by code point. */
+int compare_entries(const void *a, const void *b) {
+    const Entry *left = *(const Entry *const *)a;
+    const Entry *right = *(const Entry *const *)b;
+    size_t length = left->key_length < right->key_length ? left->key_length
+                                                         : right->key_length;
+    int result = memcmp(entry_key(left), entry_key(right), length);
+    if (result != 0) {
+        return result;
+    }
+    return (left->key_length > right->key_length) -
+           (left->key_length < right->key_length);
+}
 
-        pthread_mutex_lock(&read_queue_exit_count_semaphore);
+/* The occupied slots of `table` in name order, freed by the caller. */
+Entry **sort_entries(HashTable *table, size_t *count) {
+    Entry **sorted = malloc(sizeof(Entry *) * (table->count + 1));
+    *count = 0;
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key_length != 0) {
+            sorted[(*count)++] = &table->entries[i];
+        }
+    }
+    qsort(sorted, *count, sizeof(Entry *), compare_entries);
+    return sorted;
+}
 
-        if (*my_data->finished_reader_threads == NUMBER_OF_READER_THREADS) {
+/*
+ * Prints {name=min/mean/max, ...} sorted by name, with --percentiles
+ * {name=min/mean/max/median/p90/p99, ...}. The whole line is formatted into
+ * one buffer sized up front and handed to a single write.
+ */
+void print_results(HashTable *table) {
+    size_t count;
+    Entry **sorted = sort_entries(table, &count);
+    size_t buffer_size = 3;
+    for (size_t i = 0; i < count; i++) {
+        /* name, '=', three values of at most 5 bytes, two '/', ", " */
+        buffer_size += sorted[i]->key_length + 1 + 3 * 5 + 2 + 2;
+        if (config.percentiles) {
+            buffer_size += 3 * (1 + 5);
+        }
+    }
 
-            pthread_mutex_unlock(&read_queue_exit_count_semaphore);
-            pthread_exit(NULL);
+    char *buffer = malloc(buffer_size);
+    size_t used = 0;
+    buffer[used++] = '{';
+    for (size_t i = 0; i < count; i++) {
+        Entry *entry = sorted[i];
+        Station *s = &entry->value;
+        if (i > 0) {
+            buffer[used++] = ',';
+            buffer[used++] = ' ';
+        }
+        memcpy(buffer + used, entry_key(entry), entry->key_length);
+        used += entry->key_length;
+        buffer[used++] = '=';
+        used += format_tenths(buffer + used, s->min_temp);
+        buffer[used++] = '/';
+        used += format_tenths(buffer + used, round_mean(s->sum_temp, s->count));
+        buffer[used++] = '/';
+        used += format_tenths(buffer + used, s->max_temp);
+        if (s->histogram != NULL) {
+            int64_t percentiles[3];
+            compute_percentiles(s, percentiles);
+            for (int p = 0; p < 3; p++) {
+                buffer[used++] = '/';
+                used += format_tenths(buffer + used, percentiles[p]);
+            }
         }
+    }
+    buffer[used++] = '}';
+    buffer[used++] = '\n';
 
-        pthread_mutex_unlock(&read_queue_exit_count_semaphore);
+    fflush(stdout);
+    for (size_t written = 0; written < used;) {
+        ssize_t result = write(STDOUT_FILENO, buffer + written, used - written);
+        if (result < 0) {
+            perror("Error writing results");
+            exit(EXIT_FAILURE);
+        }
+        written += result;
+    }
 
-        usleep(10000);
-        continue;
+    free(buffer);
+    free(sorted);
+}
 
-        pthread_mutex_unlock(
-            &file_queue_semaphores[index_by_alphabet(my_data->queue_letter)]);
+int32_t return_max(int32_t a, int32_t b) { return (a > b) ? a : b; }
+int32_t return_min(int32_t a, int32_t b) { return (a < b) ? a : b; }
 
-        char *station_name = strtok(buffer_start, ";");
+/*
+ * Slow path for anything that is not -?d.d or -?dd.d: accepts -?\d+(\.\d)?
+ * within -99.9..99.9 and rejects everything else.
+ */
+bool parse_temperature_checked(const char *start, const char *end,
+                               int32_t *tenths) {
+    const char *cursor = start;
+    bool negative = cursor < end && *cursor == '-';
+    if (negative) {
+        cursor++;
+    }
 
-        if (station_name == NULL) {
-            continue;
+    int32_t value = 0;
+    const char *digits_start = cursor;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+        value = value * 10 + (*cursor - '0');
+        if (value > 99) {
+            return false;
         }
+        cursor++;
+    }
+    if (cursor == digits_start) {
+        return false;
+    }
 
-        char *temperature_str = strtok(NULL, "\n");
-
-        if (temperature_str == NULL) {
-            continue;
+    value *= 10;
+    if (cursor < end && *cursor == '.') {
+        cursor++;
+        if (cursor == end || *cursor < '0' || *cursor > '9') {
+            return false;
         }
-        float temperature = atof(temperature_str);
+        value += *cursor - '0';
+        cursor++;
+    }
+    if (cursor != end) {
+        return false;
+    }
 
-        pthread_mutex_lock(
-            &table_semaphores[index_by_alphabet(my_data->queue_letter)]);
-        Station *existing_station = ht_get(my_data->table, station_name);
+    *tenths = negative ? -value : value;
+    return true;
+}
 
-        if (existing_station != NULL) {
-            existing_station->average_temp =
-                calculate_average(existing_station->count,
-                                  existing_station->average_temp, temperature);
-            existing_station->count += 1;
-            existing_station->max_temp =
-                return_max(existing_station->max_temp, temperature);
-            existing_station->min_temp =
-                return_min(existing_station->min_temp, temperature);
-
-            pthread_mutex_unlock(
-                &table_semaphores[index_by_alphabet(my_data->queue_letter)]);
+/*
+ * Parses the temperature in [start, end) into tenths of a degree. The input
+ * is almost always -?d.d or -?dd.d, which is handled with a couple of
+ * compares and no float math; anything else falls back to the checked path.
+ */
+static inline bool parse_temperature(const char *start, const char *end,
+                                     int32_t *tenths) {
+    size_t length = end - start;
+    int32_t sign = 1;
+    const char *digits = start;
+    if (length > 0 && *digits == '-') {
+        sign = -1;
+        digits++;
+        length--;
+    }
 
-            continue;
+    if (length == 3 && digits[1] == '.') {
+        unsigned int ones = (unsigned char)digits[0] - '0';
+        unsigned int decimal = (unsigned char)digits[2] - '0';
+        if ((ones | decimal) < 10) {
+            *tenths = sign * (int32_t)(ones * 10 + decimal);
+            return true;
+        }
+    } else if (length == 4 && digits[2] == '.') {
+        unsigned int tens = (unsigned char)digits[0] - '0';
+        unsigned int ones = (unsigned char)digits[1] - '0';
+        unsigned int decimal = (unsigned char)digits[3] - '0';
+        if ((tens | ones | decimal) < 10) {
+            *tenths = sign * (int32_t)(tens * 100 + ones * 10 + decimal);
+            return true;
         }
-        Station *s = malloc(sizeof(Station));
-        strncpy(s->name, station_name, sizeof(s->name) - 1);
-        s->average_temp = calculate_average(0, 0.0, temperature);
-        s->min_temp = temperature;
-        s->max_temp = temperature;
-        s->count = 1;
-
-        ht_set(my_data->table, station_name, s);
-        pthread_mutex_unlock(
-            &table_semaphores[index_by_alphabet(my_data->queue_letter)]);
     }
 
-    pthread_exit(NULL);
+    return parse_temperature_checked(start, end, tenths);
 }
 
-FILE *open_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+void merge_station(Station *destination, const Station *source) {
+    destination->sum_temp += source->sum_temp;
+    destination->max_temp =
+        return_max(destination->max_temp, source->max_temp);
+    destination->min_temp =
+        return_min(destination->min_temp, source->min_temp);
+    destination->count += source->count;
+    if (destination->histogram != NULL && source->histogram != NULL) {
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            destination->histogram[bucket] += source->histogram[bucket];
+        }
     }
-    return file;
 }
 
-// +----------------+        +--------------- -+       +------------------+
-// |  Reader Thread |        |      Queue      |       |   Worker Thread  |
-// +----------------+        +-----------------+       +------------------+
-// | - Reads data   | -----> |- Enqueue data   | ----->| - Dequeue data   |
-// | - Acquire file |        |- Uses semaphore |       | - Processes data |
-// |   semaphore    |        |- Manages access |       | - Updates hash   |
-// | - Release file |        |   table         |       |   table          |
-// |   semaphore    |        |                 |       |                  |
-// +----------------+        +-----------------+       +------------------+
-//
-
-int main(void) {
-    FILE *file = open_file("measurements.txt");
+/* Folds every station of `source` into `destination`. */
+void merge_tables(HashTable *destination, HashTable *source) {
+    uint64_t started = trace_begin();
+    for (size_t i = 0; i < source->capacity; i++) {
+        Entry *entry = &source->entries[i];
+        if (entry->key_length == 0) {
+            continue;
+        }
 
-    size_t file_size = get_file_size(file);
-    printf("File size: %llu bytes\n", (u_int64_t)file_size);
+        /* Slot keys are padded, so the inline compare can read them. */
+        const char *key = entry_key(entry);
+        Station *existing_station =
+            ht_get(destination, key, entry->key_length, entry->hash);
+        if (existing_station != NULL) {
+            merge_station(existing_station, &entry->value);
+            continue;
+        }
 
-    initialize_semaphores();
-    initialize_queues();
-    initialize_hash_tables();
+        /* The source's histogram goes away with the source table. */
+        Station station = entry->value;
+        if (station.histogram != NULL) {
+            station.histogram = allocate_histogram(destination);
+            memcpy(station.histogram, entry->value.histogram,
+                   HISTOGRAM_BUCKETS * sizeof(uint32_t));
+        }
+        ht_set(destination, key, entry->key_length, entry->hash, &station);
+    }
+    trace_end(TRACE_MERGE, started);
+}
 
-    int reader_threads_ids[NUMBER_OF_READER_THREADS];
-    pthread_t reader_threads[NUMBER_OF_READER_THREADS];
-    struct reader_thread_data reader_thread_data[NUMBER_OF_READER_THREADS];
+/*
+ * Pipeline shard of a station. Uses the high bits of the name hash through a
+ * multiply, the tables probe with the low bits, so shards stay evenly loaded
+ * whatever the names look like.
+ */
+static inline int shard_of(uint32_t name_hash) {
+    return (int)(((uint64_t)name_hash * config.shards) >> 32);
+}
 
-    int read_rc;
-    int file_read_count = 0;
-    int finished_reader_threads = 0;
-    int file_mmap_offset = 0;
+void message(const char *message, int thread_type, int thread_id,
+             int semaphore_type) {
+    if (ENABLE_DEBUG_PRINTS == 0) {
+        return;
+    }
+    printf("%s\n", message);
+}
 
-    for (int i = 0; i < NUMBER_OF_READER_THREADS; i++) {
-        reader_thread_data[i].file_read_count = &file_read_count;
-        reader_thread_data[i].finished_reader_threads =
-            &finished_reader_threads;
+/* Only regular files can be mapped, pipes and FIFOs have to be streamed. */
+bool is_regular_file(FILE *file) {
+    struct stat status;
+    return fstat(fileno(file), &status) == 0 && S_ISREG(status.st_mode);
+}
 
+/* Size of a regular file, 0 for anything that cannot be seeked. */
+size_t get_file_size(FILE *file) {
+    struct stat status;
+    if (fstat(fileno(file), &status) != 0 || !S_ISREG(status.st_mode)) {
+        return 0;
+    }
+    return status.st_size;
+}
+
+/*
+ * Delimiter scanning over mapped data. scan_delimiter returns the first
+ * occurrence of `delimiter` in [start, end), or NULL, like memchr. It points
+ * at the widest implementation the CPU supports, picked once by
+ * initialize_scanner; every variant returns the same result as the scalar
+ * loop, which also finishes the tail shorter than a vector.
+ */
+typedef const char *(*scan_function)(const char *start, const char *end,
+                                     char delimiter);
+
+const char *scan_delimiter_scalar(const char *start, const char *end,
+                                  char delimiter) {
+    for (const char *cursor = start; cursor < end; cursor++) {
+        if (*cursor == delimiter) {
+            return cursor;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) const char *
+scan_delimiter_sse2(const char *start, const char *end, char delimiter) {
+    const __m128i pattern = _mm_set1_epi8(delimiter);
+    const char *cursor = start;
+    for (; end - cursor >= 16; cursor += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+    }
+    return scan_delimiter_scalar(cursor, end, delimiter);
+}
+
+__attribute__((target("avx2"))) const char *
+scan_delimiter_avx2(const char *start, const char *end, char delimiter) {
+    const __m256i pattern = _mm256_set1_epi8(delimiter);
+    const char *cursor = start;
+    for (; end - cursor >= 32; cursor += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        uint32_t mask =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, pattern));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+    }
+    return scan_delimiter_sse2(cursor, end, delimiter);
+}
+
+__attribute__((target("avx512bw"))) const char *
+scan_delimiter_avx512(const char *start, const char *end, char delimiter) {
+    const __m512i pattern = _mm512_set1_epi8(delimiter);
+    const char *cursor = start;
+    for (; end - cursor >= 64; cursor += 64) {
+        __m512i block = _mm512_loadu_si512((const void *)cursor);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(block, pattern);
+        if (mask != 0) {
+            return cursor + __builtin_ctzll(mask);
+        }
+    }
+    return scan_delimiter_avx2(cursor, end, delimiter);
+}
+#endif
+
+scan_function scan_delimiter = scan_delimiter_scalar;
+
+char *get_scanner_name() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (scan_delimiter == scan_delimiter_avx512) {
+        return "avx512";
+    }
+    if (scan_delimiter == scan_delimiter_avx2) {
+        return "avx2";
+    }
+    if (scan_delimiter == scan_delimiter_sse2) {
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+void initialize_scanner() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        scan_delimiter = scan_delimiter_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan_delimiter = scan_delimiter_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_delimiter = scan_delimiter_sse2;
+    }
+#endif
+}
+
+/*
+ * Every mapping of the input goes through here, so --madvise and --populate
+ * apply to all engines alike.
+ */
+const char *map_file(int fd, size_t offset, size_t length) {
+    uint64_t started = trace_begin();
+    int flags = MAP_PRIVATE | (config.populate ? MAP_POPULATE : 0);
+    void *memory = mmap(NULL, length, PROT_READ, flags, fd, offset);
+    if (memory == MAP_FAILED) {
+        perror("mmap failed, killing process");
+        exit(EXIT_FAILURE);
+    }
+    if (config.mapping_advice != MADV_NORMAL) {
+        madvise(memory, length, config.mapping_advice);
+    }
+    trace_end(TRACE_MMAP, started);
+    return memory;
+}
+
+/*
+ * Drops the pages lying entirely inside a consumed range. Pages shared with
+ * a neighbouring range stay until the mapping goes away.
+ */
+void release_range(const char *start, const char *end) {
+    uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t first = ((uintptr_t)start + page_mask) & ~page_mask;
+    uintptr_t last = (uintptr_t)end & ~page_mask;
+    if (last > first) {
+        madvise((void *)first, last - first, MADV_DONTNEED);
+    }
+}
+
+void release_window(MappedWindow *window) {
+    if (atomic_fetch_sub(&window->consumers, 1) == 1) {
+        munmap(window->memory, window->mapped_length);
+        free(window);
+    }
+}
+
+LineBatch *create_line_batch(MappedWindow *window) {
+    LineBatch *batch = malloc(sizeof(LineBatch));
+    batch->window = window;
+    batch->count = 0;
+    atomic_fetch_add(&window->consumers, 1);
+    return batch;
+}
+
+void dispatch_line_batch(int queue_index, LineBatch *batch) {
+    enqueue(file_queues[queue_index], batch);
+}
+
+/*
+ * Maps the window starting at `offset` plus enough overlap to finish the
+ * line that crosses the end of the window. A window owns the lines that start
+ * after the first newline at or past its offset, up to and including the
+ * first newline at or past the next window's offset, so consecutive windows
+ * split the file on line boundaries without copying anything.
+ */
+MappedWindow *map_window(int fd, size_t file_size, size_t offset,
+                         const char **start, const char **end) {
+    size_t bytes_to_map = config.chunk_size + MAX_BUFFER_SIZE;
+    if (offset + bytes_to_map > file_size) {
+        bytes_to_map = file_size - offset;
+    }
+
+    void *file_memory = (void *)map_file(fd, offset, bytes_to_map);
+
+    MappedWindow *window = malloc(sizeof(MappedWindow));
+    window->memory = file_memory;
+    window->mapped_length = bytes_to_map;
+    atomic_init(&window->consumers, 1);
+
+    const char *memory = file_memory;
+    const char *memory_end = memory + bytes_to_map;
+
+    *start = memory;
+    if (offset > 0) {
+        const char *newline = scan_delimiter(memory, memory_end, '\n');
+        *start = newline == NULL ? memory_end : newline + 1;
+    }
+
+    *end = memory_end;
+    if (bytes_to_map > config.chunk_size) {
+        const char *newline =
+            scan_delimiter(memory + config.chunk_size, memory_end, '\n');
+        if (newline != NULL) {
+            *end = newline + 1;
+        }
+    }
+    if (*start > *end) {
+        *start = *end;
+    }
+
+    return window;
+}
+
+/* Claims the next window offset, false once the whole file was handed out. */
+bool claim_next_window(size_t file_size, size_t *file_mmap_offset,
+                       size_t *offset) {
+    lock_counted(&file_mmap_offset_semaphore);
+    *offset = *file_mmap_offset;
+    bool claimed = *offset < file_size;
+    if (claimed) {
+        *file_mmap_offset += config.chunk_size;
+    }
+    pthread_mutex_unlock(&file_mmap_offset_semaphore);
+    return claimed;
+}
+
+/*
+ * CPUs the process may run on, grouped by NUMA node. Thread i of n is pinned
+ * to placement_cpus[i * placement_cpu_count / n], so consecutive workers,
+ * and with them consecutive file ranges of the static and work-stealing
+ * engines, share a socket.
+ */
+int placement_cpus[CPU_SETSIZE];
+int placement_cpu_count;
+
+/* NUMA node of `cpu` from sysfs, 0 when the kernel exposes no topology. */
+int get_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *directory = opendir(path);
+    if (directory == NULL) {
+        return 0;
+    }
+
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 &&
+            isdigit((unsigned char)entry->d_name[4])) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(directory);
+    return node;
+}
+
+void initialize_placement() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity failed, killing process");
+        exit(EXIT_FAILURE);
+    }
+
+    int nodes[CPU_SETSIZE];
+    placement_cpu_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        /* Insertion by node keeps the CPU order within a node. */
+        int node = get_cpu_node(cpu);
+        int i = placement_cpu_count++;
+        while (i > 0 && nodes[i - 1] > node) {
+            nodes[i] = nodes[i - 1];
+            placement_cpus[i] = placement_cpus[i - 1];
+            i--;
+        }
+        nodes[i] = node;
+        placement_cpus[i] = cpu;
+    }
+
+    int number_of_nodes = placement_cpu_count > 0 ? 1 : 0;
+    for (int i = 1; i < placement_cpu_count; i++) {
+        number_of_nodes += nodes[i] != nodes[i - 1];
+    }
+    fprintf(stderr, "Pinning to %d CPUs on %d NUMA nodes\n",
+            placement_cpu_count, number_of_nodes);
+}
+
+void pin_current_thread(int index, int count) {
+    if (!config.pin_threads) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(placement_cpus[(long)index * placement_cpu_count / count], &cpus);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc) {
+        printf("Error:unable to pin thread, %d\n", rc);
+        exit(-1);
+    }
+}
+
+/*
+ * Pins a worker and creates its private table when it was handed none, so
+ * the table and its arena are first touched on the worker's own node.
+ */
+void place_worker(int index, int count, HashTable **table) {
+    pin_current_thread(index, count);
+    if (*table == NULL) {
+        *table = create_table();
+    }
+}
+
+void *process_file_data(void *threadarg) {
+    reader_thread_data *my_data = (reader_thread_data *)threadarg;
+    size_t offset;
+
+    register_counters("reader", my_data->thread_id);
+    pin_current_thread(my_data->thread_id,
+                       config.reader_threads +
+                           config.shards * config.writers_per_shard);
+    LineBatch **batches = malloc(sizeof(LineBatch *) * config.shards);
+
+    while (claim_next_window(my_data->file_size, my_data->file_mmap_offset,
+                             &offset)) {
+        const char *start;
+        const char *end;
+        MappedWindow *window = map_window(
+            fileno(my_data->file), my_data->file_size, offset, &start, &end);
+
+        memset(batches, 0, sizeof(LineBatch *) * config.shards);
+        COUNT(chunks, 1);
+        COUNT(bytes, end - start);
+        uint64_t started = trace_begin();
+
+        for (const char *line = start; line < end;) {
+            const char *newline = scan_delimiter(line, end, '\n');
+            const char *line_end = newline == NULL ? end : newline;
+
+            uint32_t name_hash;
+            const char *separator = scan_name(line, line_end, &name_hash);
+            if (separator == NULL) {
+                line = line_end + 1;
+                continue;
+            }
+
+            int queue_index = shard_of(name_hash);
+            if (batches[queue_index] == NULL) {
+                batches[queue_index] = create_line_batch(window);
+            }
+
+            LineBatch *batch = batches[queue_index];
+            LineView *view = &batch->lines[batch->count++];
+            view->start = line;
+            view->length = line_end - line;
+            view->name_length = separator - line;
+            view->hash = name_hash;
+
+            if (batch->count == LINE_BATCH_SIZE) {
+                dispatch_line_batch(queue_index, batch);
+                batches[queue_index] = NULL;
+            }
+
+            line = line_end + 1;
+        }
+
+        for (int i = 0; i < config.shards; i++) {
+            if (batches[i] != NULL) {
+                dispatch_line_batch(i, batches[i]);
+            }
+        }
+        trace_end(TRACE_ROUTE, started);
+
+        release_window(window);
+    }
+
+    for (int i = 0; i < config.shards; i++) {
+        queue_producer_done(file_queues[i]);
+    }
+
+    free(batches);
+    pthread_exit(NULL);
+}
+
+/*
+ * Adds one reading to its station. The name is already split off and hashed;
+ * `line_end` closes the temperature and `limit` is the end of readable memory
+ * after the line, which lets short names be compared straight from the input.
+ */
+void insert_station(const char *station_name, size_t name_length,
+                    uint32_t name_hash, const char *line_end,
+                    const char *limit, HashTable *table,
+                    pthread_mutex_t *table_semaphore) {
+    if (name_length == 0) {
+        return;
+    }
+
+    int32_t tenths;
+    if (!parse_temperature(station_name + name_length + 1, line_end,
+                           &tenths)) {
+        return;
+    }
+    COUNT(rows, 1);
+
+    /* Only the last lines before `limit` need a padded copy. */
+    char padded_name[INLINE_KEY_SIZE];
+    if (name_length <= INLINE_KEY_SIZE &&
+        limit - station_name < INLINE_KEY_SIZE) {
+        memset(padded_name, 0, sizeof(padded_name));
+        memcpy(padded_name, station_name, name_length);
+        station_name = padded_name;
+    }
+
+    if (table_semaphore != NULL) {
+        lock_counted(table_semaphore);
+    }
+    Station *existing_station =
+        ht_get(table, station_name, name_length, name_hash);
+
+    if (existing_station != NULL) {
+        existing_station->sum_temp += tenths;
+        existing_station->count += 1;
+        existing_station->max_temp =
+            return_max(existing_station->max_temp, tenths);
+        existing_station->min_temp =
+            return_min(existing_station->min_temp, tenths);
+        if (existing_station->histogram != NULL) {
+            existing_station->histogram[tenths + HISTOGRAM_OFFSET]++;
+        }
+
+        if (table_semaphore != NULL) {
+            pthread_mutex_unlock(table_semaphore);
+        }
+        return;
+    }
+    Station s = {0};
+    s.sum_temp = tenths;
+    s.min_temp = tenths;
+    s.max_temp = tenths;
+    s.count = 1;
+    if (config.percentiles) {
+        s.histogram = allocate_histogram(table);
+        s.histogram[tenths + HISTOGRAM_OFFSET] = 1;
+    }
+
+    ht_set(table, station_name, name_length, name_hash, &s);
+    if (table_semaphore != NULL) {
+        pthread_mutex_unlock(table_semaphore);
+    }
+}
+
+void insert_line_into_table(LineView line, const char *limit,
+                            HashTable *table,
+                            pthread_mutex_t *table_semaphore) {
+    const char *line_end = line.start + line.length;
+    uint32_t name_hash;
+    const char *separator = scan_name(line.start, line_end, &name_hash);
+    if (separator == NULL) {
+        return;
+    }
+
+    insert_station(line.start, separator - line.start, name_hash, line_end,
+                   limit, table, table_semaphore);
+}
+
+void *insert_data_into_table(void *arg) {
+
+    writer_thread_data *my_data = (writer_thread_data *)arg;
+    register_counters("writer", my_data->thread_id);
+    place_worker(config.reader_threads + my_data->thread_id,
+                 config.reader_threads +
+                     config.shards * config.writers_per_shard,
+                 &my_data->table);
+    int shard = my_data->shard;
+    pthread_mutex_t *table_semaphore =
+        config.thread_local_tables ? NULL : &table_semaphores[shard];
+
+    for (;;) {
+        LineBatch *batch = dequeue(file_queues[shard]);
+        if (batch == NULL) {
+            pthread_exit(NULL);
+        }
+
+        uint64_t started = trace_begin();
+        const char *limit =
+            (const char *)batch->window->memory + batch->window->mapped_length;
+        for (u_int32_t i = 0; i < batch->count; i++) {
+            LineView *line = &batch->lines[i];
+            insert_station(line->start, line->name_length, line->hash,
+                           line->start + line->length, limit, my_data->table,
+                           table_semaphore);
+        }
+        my_data->rows += batch->count;
+        my_data->batches++;
+        trace_end(TRACE_PARSE, started);
+
+        release_window(batch->window);
+        free(batch);
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Aggregates every line in [start, end) into `table`. */
+void process_chunk(const char *start, const char *end, HashTable *table,
+                   pthread_mutex_t *table_semaphore) {
+    COUNT(chunks, 1);
+    COUNT(bytes, end - start);
+    uint64_t started = trace_begin();
+    for (const char *line = start; line < end;) {
+        const char *newline = scan_delimiter(line, end, '\n');
+        const char *line_end = newline == NULL ? end : newline;
+
+        LineView view = {.start = line, .length = line_end - line};
+        insert_line_into_table(view, end, table, table_semaphore);
+
+        line = line_end + 1;
+    }
+    trace_end(TRACE_PARSE, started);
+}
+
+/*
+ * process_chunk over a range of a long lived mapping. With --release it
+ * works through the range a morsel at a time and drops every consumed piece,
+ * which caps RSS at roughly a morsel per worker instead of the whole file.
+ */
+void process_mapped_range(const char *start, const char *end,
+                          HashTable *table, pthread_mutex_t *table_semaphore) {
+    if (!config.release_pages) {
+        process_chunk(start, end, table, table_semaphore);
+        return;
+    }
+
+    while (start < end) {
+        const char *stop = end;
+        if ((size_t)(end - start) > config.morsel_size) {
+            const char *newline =
+                scan_delimiter(start + config.morsel_size, end, '\n');
+            stop = newline == NULL ? end : newline + 1;
+        }
+        process_chunk(start, stop, table, table_semaphore);
+        release_range(start, stop);
+        start = stop;
+    }
+}
+
+/*
+ * Worker loop of the sequential, locked and thread-local engines: claims
+ * windows until the file is exhausted and aggregates them directly. Returns
+ * instead of calling pthread_exit so the sequential engine can run it on the
+ * main thread.
+ */
+void *process_file_windows(void *threadarg) {
+    worker_thread_data *my_data = (worker_thread_data *)threadarg;
+    size_t offset;
+
+    register_counters("worker", my_data->thread_id);
+    place_worker(my_data->thread_id, config.threads, &my_data->table);
+
+    while (claim_next_window(my_data->file_size, my_data->file_mmap_offset,
+                             &offset)) {
+        const char *start;
+        const char *end;
+        MappedWindow *window = map_window(
+            fileno(my_data->file), my_data->file_size, offset, &start, &end);
+
+        process_mapped_range(start, end, my_data->table,
+                             my_data->table_semaphore);
+
+        release_window(window);
+    }
+
+    return NULL;
+}
+
+FILE *open_file(const char *filename) {
+    if (strcmp(filename, STDIN_PATH) == 0) {
+        return stdin;
+    }
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+HashTable *run_sequential(FILE *file, size_t file_size) {
+    size_t file_mmap_offset = 0;
+    worker_thread_data data = {
+        .thread_id = 0,
+        .file = file,
+        .file_size = file_size,
+        .file_mmap_offset = &file_mmap_offset,
+        .table = create_table(),
+        .table_semaphore = NULL,
+    };
+
+    process_file_windows(&data);
+    return data.table;
+}
+
+/*
+ * The locked engine shares one table guarded by a mutex taken per row, the
+ * thread-local engine gives every worker its own table and merges them in
+ * thread order after the join.
+ */
+HashTable *run_worker_threads(FILE *file, size_t file_size,
+                              bool thread_local_tables) {
+    HashTable *table = create_table();
+    pthread_mutex_t table_semaphore = PTHREAD_MUTEX_INITIALIZER;
+    size_t file_mmap_offset = 0;
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * config.threads);
+    worker_thread_data *td =
+        malloc(sizeof(worker_thread_data) * config.threads);
+
+    for (int i = 0; i < config.threads; i++) {
+        td[i].thread_id = i;
+        td[i].file = file;
+        td[i].file_size = file_size;
+        td[i].file_mmap_offset = &file_mmap_offset;
+        td[i].table = thread_local_tables ? NULL : table;
+        td[i].table_semaphore = thread_local_tables ? NULL : &table_semaphore;
+
+        int rc =
+            pthread_create(&threads[i], NULL, process_file_windows, &td[i]);
+        if (rc) {
+            printf("Error:unable to create thread, %d\n", rc);
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            printf("ERROR : pthread join failed.\n");
+            exit(-1);
+        }
+
+        if (thread_local_tables) {
+            merge_tables(table, td[i].table);
+            free_table(td[i].table);
+        }
+    }
+
+    pthread_mutex_destroy(&table_semaphore);
+    free(threads);
+    free(td);
+    return table;
+}
+
+/*
+ * Splits [memory, memory + size) into `parts` ranges of roughly equal size,
+ * each moved forward to start right after a newline. boundaries holds
+ * parts + 1 pointers, range i is [boundaries[i], boundaries[i + 1]).
+ */
+void split_on_lines(const char *memory, size_t size, int parts,
+                    const char **boundaries) {
+    const char *memory_end = memory + size;
+    boundaries[0] = memory;
+    for (int i = 1; i < parts; i++) {
+        const char *target = memory + size / parts * i;
+        if (target < boundaries[i - 1]) {
+            target = boundaries[i - 1];
+        }
+        const char *newline = scan_delimiter(target, memory_end, '\n');
+        boundaries[i] = newline == NULL ? memory_end : newline + 1;
+    }
+    boundaries[parts] = memory_end;
+}
+
+const char *map_whole_file(FILE *file, size_t file_size) {
+    return map_file(fileno(file), 0, file_size);
+}
+
+void *process_file_range(void *threadarg) {
+    range_thread_data *my_data = (range_thread_data *)threadarg;
+    register_counters("worker", my_data->thread_id);
+    place_worker(my_data->thread_id, config.threads, &my_data->table);
+    process_mapped_range(my_data->start, my_data->end, my_data->table, NULL);
+    pthread_exit(NULL);
+}
+
+/*
+ * Maps [start, end) of the file once and gives every worker a fixed, line
+ * aligned byte range up front, so workers share no offset, lock or table
+ * while running. Private tables are merged in thread order after the join.
+ * `start` has to be the beginning of a line; the static engine passes the
+ * whole file, snapshots only the appended tail.
+ */
+HashTable *run_static_ranges(FILE *file, size_t start, size_t end) {
+    HashTable *table = create_table();
+    if (end <= start) {
+        return table;
+    }
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t map_offset = start / page_size * page_size;
+    size_t map_length = end - map_offset;
+    const char *memory = map_file(fileno(file), map_offset, map_length);
+
+    const char **boundaries = malloc(sizeof(char *) * (config.threads + 1));
+    split_on_lines(memory + (start - map_offset), end - start, config.threads,
+                   boundaries);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * config.threads);
+    range_thread_data *td = malloc(sizeof(range_thread_data) * config.threads);
+
+    for (int i = 0; i < config.threads; i++) {
+        td[i].thread_id = i;
+        td[i].start = boundaries[i];
+        td[i].end = boundaries[i + 1];
+        td[i].table = NULL;
+
+        int rc = pthread_create(&threads[i], NULL, process_file_range, &td[i]);
+        if (rc) {
+            printf("Error:unable to create thread, %d\n", rc);
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            printf("ERROR : pthread join failed.\n");
+            exit(-1);
+        }
+        merge_tables(table, td[i].table);
+        free_table(td[i].table);
+    }
+
+    munmap((void *)memory, map_length);
+    free(boundaries);
+    free(threads);
+    free(td);
+    return table;
+}
+
+/* Owner side: takes the bottom morsel, false once the deque is empty. */
+bool deque_pop(WorkDeque *deque, long *morsel) {
+    long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+        return false;
+    }
+
+    *morsel = bottom;
+    if (top < bottom) {
+        return true;
+    }
+
+    /* Last morsel, race the thieves for it. */
+    bool won = atomic_compare_exchange_strong_explicit(
+        &deque->top, &top, top + 1, memory_order_seq_cst,
+        memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+}
+
+/* Thief side: takes the top morsel, false only once the deque is empty. */
+bool deque_steal(WorkDeque *deque, long *morsel) {
+    for (;;) {
+        long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        long bottom =
+            atomic_load_explicit(&deque->bottom, memory_order_acquire);
+        if (top >= bottom) {
+            return false;
+        }
+        if (atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst,
+                memory_order_relaxed)) {
+            *morsel = top;
+            return true;
+        }
+        cpu_relax();
+    }
+}
+
+void *process_morsels(void *threadarg) {
+    steal_thread_data *my_data = (steal_thread_data *)threadarg;
+    WorkDeque *own = &my_data->deques[my_data->thread_id];
+    long morsel;
+
+    register_counters("worker", my_data->thread_id);
+    /* Victims are tried in id order, neighbours first, same node first. */
+    place_worker(my_data->thread_id, config.threads, &my_data->table);
+
+    for (;;) {
+        bool found = deque_pop(own, &morsel);
+
+        /* Work is never added back, so all victims empty means done. */
+        for (int v = 1; !found && v < my_data->number_of_threads; v++) {
+            int victim = (my_data->thread_id + v) % my_data->number_of_threads;
+            found = deque_steal(&my_data->deques[victim], &morsel);
+        }
+        if (!found) {
+            break;
+        }
+
+        process_mapped_range(my_data->morsel_boundaries[morsel],
+                             my_data->morsel_boundaries[morsel + 1],
+                             my_data->table, NULL);
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Maps the whole file once and cuts it into many small line-aligned morsels.
+ * Each worker starts with a contiguous share in its own deque and steals
+ * from the others once it runs dry, so slow or throttled cores only delay
+ * the morsels they are actually working on.
+ */
+HashTable *run_work_stealing(FILE *file, size_t file_size) {
+    HashTable *table = create_table();
+    if (file_size == 0) {
+        return table;
+    }
+
+    const char *memory = map_whole_file(file, file_size);
+
+    long morsels = (file_size + config.morsel_size - 1) / config.morsel_size;
+    const char **boundaries = malloc(sizeof(char *) * (morsels + 1));
+    split_on_lines(memory, file_size, morsels, boundaries);
+
+    WorkDeque *deques =
+        aligned_alloc(CACHE_LINE_SIZE, sizeof(WorkDeque) * config.threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * config.threads);
+    steal_thread_data *td = malloc(sizeof(steal_thread_data) * config.threads);
+
+    for (int i = 0; i < config.threads; i++) {
+        atomic_init(&deques[i].top, morsels * i / config.threads);
+        atomic_init(&deques[i].bottom, morsels * (i + 1) / config.threads);
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        td[i].thread_id = i;
+        td[i].number_of_threads = config.threads;
+        td[i].deques = deques;
+        td[i].morsel_boundaries = boundaries;
+        td[i].table = NULL;
+
+        int rc = pthread_create(&threads[i], NULL, process_morsels, &td[i]);
+        if (rc) {
+            printf("Error:unable to create thread, %d\n", rc);
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            printf("ERROR : pthread join failed.\n");
+            exit(-1);
+        }
+        merge_tables(table, td[i].table);
+        free_table(td[i].table);
+    }
+
+    munmap((void *)memory, file_size);
+    free(boundaries);
+    free(deques);
+    free(threads);
+    free(td);
+    return table;
+}
+
+/* Reverse scan, only ever walks back over the last partial line. */
+const char *find_last_newline(const char *start, const char *end) {
+    for (const char *p = end; p > start; p--) {
+        if (p[-1] == '\n') {
+            return p - 1;
+        }
+    }
+    return NULL;
+}
+
+/* Fills `length` bytes unless the input ends first, returns the bytes read. */
+size_t read_fully(int fd, char *destination, size_t length) {
+    size_t filled = 0;
+    while (filled < length) {
+        ssize_t bytes = read(fd, destination + filled, length - filled);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read failed, killing process");
+            exit(EXIT_FAILURE);
+        }
+        if (bytes == 0) {
+            break;
+        }
+        filled += bytes;
+    }
+    return filled;
+}
+
+/* Same as read_fully at an explicit offset, for regular files. */
+size_t pread_fully(int fd, char *destination, size_t length, size_t offset) {
+    size_t filled = 0;
+    while (filled < length) {
+        ssize_t bytes =
+            pread(fd, destination + filled, length - filled, offset + filled);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread failed, killing process");
+            exit(EXIT_FAILURE);
+        }
+        if (bytes == 0) {
+            break;
+        }
+        filled += bytes;
+    }
+    return filled;
+}
+
+/*
+ * Puts the partial line carried over from the previous buffer in front of
+ * the `length` bytes just read into `buffer`, cuts the buffer after its last
+ * newline (unless the input ended) and queues the complete lines.
+ */
+void hand_off_buffer(stream_thread_data *my_data, StreamBuffer *buffer,
+                     size_t length, bool end_of_input, StreamCarry *carry) {
+    char *start = buffer->data - carry->length;
+    memcpy(start, carry->bytes, carry->length);
+    buffer->start = start;
+    buffer->end = buffer->data + length;
+    carry->length = 0;
+
+    if (!end_of_input) {
+        const char *last_newline =
+            find_last_newline(buffer->start, buffer->end);
+        size_t tail = last_newline == NULL
+                          ? MAX_BUFFER_SIZE + 1
+                          : (size_t)(buffer->end - last_newline - 1);
+        if (tail > MAX_BUFFER_SIZE) {
+            fprintf(stderr, "Line longer than %d bytes, killing process\n",
+                    MAX_BUFFER_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(carry->bytes, last_newline + 1, tail);
+        carry->length = tail;
+        buffer->end = last_newline + 1;
+    }
+
+    if (buffer->end > buffer->start) {
+        enqueue(my_data->filled_buffers, buffer);
+    } else {
+        enqueue(my_data->free_buffers, buffer);
+    }
+}
+
+/* Reader of the stream engine, one blocking read() per free buffer. */
+void *read_stream(void *threadarg) {
+    stream_thread_data *my_data = (stream_thread_data *)threadarg;
+    StreamCarry carry = {.length = 0};
+
+    register_counters("reader", my_data->thread_id);
+    pin_current_thread(my_data->thread_id, config.threads + 1);
+
+    /* file_size is the byte limit here, SIZE_MAX reads to the end. */
+    size_t remaining = my_data->file_size;
+    for (;;) {
+        StreamBuffer *buffer = dequeue(my_data->free_buffers);
+        size_t wanted =
+            remaining < config.morsel_size ? remaining : config.morsel_size;
+        uint64_t started = trace_begin();
+        size_t length = read_fully(my_data->fd, buffer->data, wanted);
+        trace_end(TRACE_READ, started);
+        remaining -= length;
+        bool end_of_input = length < config.morsel_size || remaining == 0;
+
+        hand_off_buffer(my_data, buffer, length, end_of_input, &carry);
+        if (end_of_input) {
+            break;
+        }
+    }
+
+    queue_producer_done(my_data->filled_buffers);
+    pthread_exit(NULL);
+}
+
+/*
+ * Minimal io_uring setup over the raw system calls, only what a queue of
+ * reads needs. The rings are sized to the buffer pool, so the submission
+ * queue can never overflow and its head is never looked at.
+ */
+bool uring_setup(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->fixed_buffers = false;
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        ring->sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void uring_teardown(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/*
+ * Pins the data part of every buffer so reads can use READ_FIXED and skip
+ * the per-request page lookups. When this fails, for example under a low
+ * RLIMIT_MEMLOCK, reads fall back to READV: it dates from the same kernel
+ * as io_uring itself, while plain READ would need 5.6.
+ */
+void uring_register_buffers(Uring *ring, StreamBuffer *buffers, int count) {
+    struct iovec *vectors = malloc(sizeof(struct iovec) * count);
+    for (int i = 0; i < count; i++) {
+        vectors[i].iov_base = buffers[i].data;
+        vectors[i].iov_len = config.morsel_size;
+    }
+    ring->fixed_buffers = syscall(__NR_io_uring_register, ring->fd,
+                                  IORING_REGISTER_BUFFERS, vectors,
+                                  count) == 0;
+    free(vectors);
+}
+
+void uring_prepare_read(Uring *ring, int fd, StreamBuffer *buffer,
+                        int buffer_index, unsigned length, size_t offset) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->off = offset;
+    if (ring->fixed_buffers) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)buffer->data;
+        sqe->len = length;
+        sqe->buf_index = buffer_index;
+    } else {
+        buffer->vector.iov_base = buffer->data;
+        buffer->vector.iov_len = length;
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)&buffer->vector;
+        sqe->len = 1;
+    }
+    sqe->user_data = (uintptr_t)buffer;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submits `to_submit` reads and waits until `wait_for` have completed. */
+void uring_enter(Uring *ring, unsigned to_submit, unsigned wait_for) {
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_for, flags,
+                   NULL, 0) < 0) {
+        if (errno != EINTR) {
+            perror("io_uring_enter failed, killing process");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Pops one completion if there is any. */
+bool uring_reap(Uring *ring, StreamBuffer **buffer, int *result) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *buffer = (StreamBuffer *)(uintptr_t)cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Reader of the uring engine. Keeps a read in flight for every free buffer,
+ * at consecutive offsets of the file, and hands completed buffers to the
+ * workers strictly in file order so the partial line carry stays correct.
+ */
+void *read_uring(void *threadarg) {
+    stream_thread_data *my_data = (stream_thread_data *)threadarg;
+    register_counters("reader", my_data->thread_id);
+    pin_current_thread(my_data->thread_id, config.threads + 1);
+    Uring *ring = my_data->ring;
+    int slots = my_data->number_of_buffers;
+    StreamBuffer **completed = calloc(slots, sizeof(StreamBuffer *));
+    StreamCarry carry = {.length = 0};
+
+    size_t offset = 0;
+    size_t submitted = 0;
+    size_t delivered = 0;
+    unsigned in_flight = 0;
+    unsigned int attempt = 0;
+
+    while (offset < my_data->file_size || in_flight > 0) {
+        unsigned queued = 0;
+        StreamBuffer *buffer;
+        while (offset < my_data->file_size &&
+               (buffer = try_dequeue(my_data->free_buffers)) != NULL) {
+            buffer->sequence = submitted++;
+            buffer->offset = offset;
+            buffer->length = my_data->file_size - offset < config.morsel_size
+                                 ? my_data->file_size - offset
+                                 : config.morsel_size;
+            /* O_DIRECT wants whole blocks, the tail read comes back short. */
+            unsigned request = (buffer->length + DIRECT_IO_ALIGNMENT - 1) &
+                               ~(DIRECT_IO_ALIGNMENT - 1);
+            uring_prepare_read(ring, my_data->fd, buffer,
+                               buffer - my_data->buffers, request, offset);
+            offset += buffer->length;
+            queued++;
+        }
+        in_flight += queued;
+
+        if (in_flight == 0) {
+            /* Every buffer is with the workers. */
+            backoff(&attempt);
+            continue;
+        }
+        attempt = 0;
+        uint64_t started = trace_begin();
+        uring_enter(ring, queued, 1);
+        trace_end(TRACE_READ, started);
+
+        int result;
+        while (uring_reap(ring, &buffer, &result)) {
+            if (result < 0) {
+                fprintf(stderr, "io_uring read failed: %s\n",
+                        strerror(-result));
+                exit(EXIT_FAILURE);
+            }
+            if ((size_t)result < buffer->length) {
+                /* Short read before the end of file, finish it by hand. */
+                pread_fully(my_data->buffered_fd, buffer->data + result,
+                            buffer->length - result, buffer->offset + result);
+            }
+            completed[buffer->sequence % slots] = buffer;
+            in_flight--;
+        }
+
+        while ((buffer = completed[delivered % slots]) != NULL) {
+            completed[delivered % slots] = NULL;
+            delivered++;
+            bool end_of_input =
+                offset == my_data->file_size && delivered == submitted;
+            hand_off_buffer(my_data, buffer, buffer->length, end_of_input,
+                            &carry);
+        }
+    }
+
+    free(completed);
+    queue_producer_done(my_data->filled_buffers);
+    pthread_exit(NULL);
+}
+
+void *process_stream_buffers(void *threadarg) {
+    stream_thread_data *my_data = (stream_thread_data *)threadarg;
+    StreamBuffer *buffer;
+
+    register_counters("worker", my_data->thread_id);
+    place_worker(my_data->thread_id, config.threads + 1, &my_data->table);
+
+    while ((buffer = dequeue(my_data->filled_buffers)) != NULL) {
+        process_chunk(buffer->start, buffer->end, my_data->table, NULL);
+        enqueue(my_data->free_buffers, buffer);
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Parsing stage shared by the stream and uring engines. A reader thread
+ * rotates a small pool of large buffers through two rings: it fills the
+ * next free buffer while the workers parse the filled ones into private
+ * tables, which are merged after the join.
+ */
+HashTable *run_buffer_pipeline(int fd, int buffered_fd, size_t file_size,
+                               Uring *ring, void *(*reader)(void *)) {
+    HashTable *table = create_table();
+
+    /* One buffer being filled, one per worker and one waiting in between. */
+    int number_of_buffers = config.threads + 2;
+    size_t capacity = 1;
+    while (capacity < (size_t)number_of_buffers) {
+        capacity <<= 1;
+    }
+    Queue *filled_buffers = create_queue(0, capacity, 1);
+    Queue *free_buffers = create_queue(1, capacity, 1);
+
+    /* Blocks of carry room in front keep the data O_DIRECT aligned. */
+    StreamBuffer *buffers = malloc(sizeof(StreamBuffer) * number_of_buffers);
+    for (int i = 0; i < number_of_buffers; i++) {
+        buffers[i].memory = aligned_alloc(
+            DIRECT_IO_ALIGNMENT, DIRECT_IO_ALIGNMENT + config.morsel_size);
+        buffers[i].data = buffers[i].memory + DIRECT_IO_ALIGNMENT;
+        enqueue(free_buffers, &buffers[i]);
+    }
+    if (ring != NULL) {
+        uring_register_buffers(ring, buffers, number_of_buffers);
+        fprintf(stderr, "io_uring buffers: %s\n",
+                ring->fixed_buffers ? "registered" : "unregistered");
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (config.threads + 1));
+    stream_thread_data *td =
+        malloc(sizeof(stream_thread_data) * (config.threads + 1));
+
+    for (int i = 0; i <= config.threads; i++) {
+        td[i].thread_id = i;
+        td[i].fd = fd;
+        td[i].buffered_fd = buffered_fd;
+        td[i].file_size = file_size;
+        td[i].ring = ring;
+        td[i].buffers = buffers;
+        td[i].number_of_buffers = number_of_buffers;
+        td[i].filled_buffers = filled_buffers;
+        td[i].free_buffers = free_buffers;
+        td[i].table = NULL;
+
+        int rc = pthread_create(&threads[i], NULL,
+                                i == 0 ? reader : process_stream_buffers,
+                                &td[i]);
+        if (rc) {
+            printf("Error:unable to create thread, %d\n", rc);
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i <= config.threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            printf("ERROR : pthread join failed.\n");
+            exit(-1);
+        }
+        if (td[i].table != NULL) {
+            merge_tables(table, td[i].table);
+            free_table(td[i].table);
+        }
+    }
+
+    for (int i = 0; i < number_of_buffers; i++) {
+        free(buffers[i].memory);
+    }
+    free(buffers);
+    free_queue(filled_buffers);
+    free_queue(free_buffers);
+    free(threads);
+    free(td);
+    return table;
+}
+
+/*
+ * Reads pipes, FIFOs and stdin, which cannot be mapped, up to `limit`
+ * bytes. Pass SIZE_MAX to read to the end, a regular file's size to stop
+ * where a snapshot's complete lines end.
+ */
+HashTable *run_stream(FILE *file, size_t limit) {
+    return run_buffer_pipeline(fileno(file), fileno(file), limit, NULL,
+                               read_stream);
+}
+
+/*
+ * Reads the file through io_uring instead of page faults, optionally with
+ * O_DIRECT to bypass the page cache. Falls back to the stream engine's plain
+ * read() loop when the kernel or a seccomp filter refuses io_uring.
+ */
+HashTable *run_uring(FILE *file, size_t file_size) {
+    int fd = fileno(file);
+    if (config.direct_io) {
+        fd = open(config.input_path, O_RDONLY | O_DIRECT);
+        if (fd < 0) {
+            fprintf(stderr, "O_DIRECT unavailable (%s), using buffered reads\n",
+                    strerror(errno));
+            fd = fileno(file);
+        }
+    }
+
+    Uring ring;
+    unsigned entries = 1;
+    while (entries < (unsigned)config.threads + 2) {
+        entries <<= 1;
+    }
+    if (!uring_setup(&ring, entries)) {
+        fprintf(stderr, "io_uring unavailable (%s), falling back to read()\n",
+                strerror(errno));
+        if (fd != fileno(file)) {
+            close(fd);
+        }
+        return run_stream(file, file_size);
+    }
+
+    HashTable *table =
+        run_buffer_pipeline(fd, fileno(file), file_size, &ring, read_uring);
+
+    uring_teardown(&ring);
+    if (fd != fileno(file)) {
+        close(fd);
+    }
+    return table;
+}
+
+size_t align_columnar(size_t offset) {
+    return (offset + COLUMNAR_ALIGNMENT - 1) / COLUMNAR_ALIGNMENT *
+           COLUMNAR_ALIGNMENT;
+}
+
+/* fwrite that gives up on the run, the output would be unusable anyway. */
+void write_columnar(FILE *out, const void *data, size_t length,
+                    size_t *position) {
+    if (fwrite(data, 1, length, out) != length) {
+        perror("Error writing columnar file");
+        exit(EXIT_FAILURE);
+    }
+    *position += length;
+}
+
+void pad_columnar(FILE *out, size_t *position) {
+    static const char zeros[COLUMNAR_ALIGNMENT];
+    write_columnar(out, zeros, align_columnar(*position) - *position,
+                   position);
+}
+
+void flush_columnar_chunk(FILE *out, size_t *position, const uint16_t *ids,
+                          const int16_t *tenths, uint32_t rows,
+                          ColumnarChunk *chunk) {
+    chunk->offset = *position;
+    chunk->rows = rows;
+    /* Plain loops over int16_t, the compiler turns them into vector min/max. */
+    int16_t min_tenths = tenths[0];
+    int16_t max_tenths = tenths[0];
+    for (uint32_t r = 1; r < rows; r++) {
+        min_tenths = tenths[r] < min_tenths ? tenths[r] : min_tenths;
+        max_tenths = tenths[r] > max_tenths ? tenths[r] : max_tenths;
+    }
+    chunk->min_tenths = min_tenths;
+    chunk->max_tenths = max_tenths;
+
+    write_columnar(out, ids, rows * sizeof(uint16_t), position);
+    pad_columnar(out, position);
+    write_columnar(out, tenths, rows * sizeof(int16_t), position);
+    pad_columnar(out, position);
+}
+
+/*
+ * --convert: `table` is the aggregate of a normal run over the same file,
+ * which gives the full dictionary up front. Ids follow name order, and a
+ * second, sequential pass over the mapped text writes the two columns.
+ */
+void convert_to_columnar(FILE *file, size_t file_size, HashTable *table,
+                         const char *path) {
+    if (table->count > MAX_COLUMNAR_STATIONS) {
+        fprintf(stderr, "Too many stations for a columnar file: %zu\n",
+                table->count);
+        exit(EXIT_FAILURE);
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("Error opening columnar file");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t station_count;
+    Entry **sorted = sort_entries(table, &station_count);
+    /* Slots do not move any more, so a slot's index maps to its id. */
+    uint16_t *slot_ids = malloc(sizeof(uint16_t) * table->capacity);
+    for (size_t i = 0; i < station_count; i++) {
+        slot_ids[sorted[i] - table->entries] = (uint16_t)i;
+    }
+
+    ColumnarHeader header = {.station_count = station_count};
+    memcpy(header.magic, COLUMNAR_MAGIC, sizeof(header.magic));
+    size_t position = 0;
+    write_columnar(out, &header, sizeof(header), &position);
+
+    header.dictionary_offset = position;
+    for (size_t i = 0; i < station_count; i++) {
+        uint16_t length = sorted[i]->key_length;
+        write_columnar(out, &length, sizeof(length), &position);
+        write_columnar(out, entry_key(sorted[i]), length, &position);
+    }
+    pad_columnar(out, &position);
+
+    size_t directory_capacity = 64;
+    ColumnarChunk *directory =
+        malloc(sizeof(ColumnarChunk) * directory_capacity);
+    uint16_t *ids = malloc(sizeof(uint16_t) * COLUMNAR_CHUNK_ROWS);
+    int16_t *tenths_column = malloc(sizeof(int16_t) * COLUMNAR_CHUNK_ROWS);
+    uint32_t rows = 0;
+
+    const char *memory = file_size > 0 ? map_whole_file(file, file_size) : "";
+    const char *end = memory + file_size;
+    for (const char *line = memory; line < end;) {
+        const char *newline = scan_delimiter(line, end, '\n');
+        const char *line_end = newline == NULL ? end : newline;
+        const char *next_line = line_end + 1;
+
+        uint32_t name_hash;
+        const char *separator = scan_name(line, line_end, &name_hash);
+        int32_t tenths;
+        if (separator == NULL || separator == line ||
+            !parse_temperature(separator + 1, line_end, &tenths)) {
+            line = next_line;
+            continue;
+        }
+
+        /* Same padding as insert_station for names close to the end. */
+        const char *name = line;
+        size_t name_length = separator - line;
+        char padded_name[INLINE_KEY_SIZE];
+        if (name_length <= INLINE_KEY_SIZE && end - name < INLINE_KEY_SIZE) {
+            memset(padded_name, 0, sizeof(padded_name));
+            memcpy(padded_name, name, name_length);
+            name = padded_name;
+        }
+        Entry *entry = ht_find_slot(table, name, name_length, name_hash);
+
+        ids[rows] = slot_ids[entry - table->entries];
+        tenths_column[rows] = (int16_t)tenths;
+        rows++;
+        header.row_count++;
+
+        if (rows == COLUMNAR_CHUNK_ROWS) {
+            if (header.chunk_count == directory_capacity) {
+                directory_capacity *= 2;
+                directory = realloc(directory, sizeof(ColumnarChunk) *
+                                                   directory_capacity);
+            }
+            flush_columnar_chunk(out, &position, ids, tenths_column, rows,
+                                 &directory[header.chunk_count++]);
+            rows = 0;
+        }
+        line = next_line;
+    }
+    if (rows > 0) {
+        if (header.chunk_count == directory_capacity) {
+            directory_capacity *= 2;
+            directory =
+                realloc(directory, sizeof(ColumnarChunk) * directory_capacity);
+        }
+        flush_columnar_chunk(out, &position, ids, tenths_column, rows,
+                             &directory[header.chunk_count++]);
+    }
+
+    header.directory_offset = position;
+    write_columnar(out, directory, sizeof(ColumnarChunk) * header.chunk_count,
+                   &position);
+    if (fseek(out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, out) != 1 || fclose(out) != 0) {
+        perror("Error writing columnar file");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr,
+            "Wrote %llu rows of %u stations in %u chunks to %s (%zu bytes)\n",
+            (unsigned long long)header.row_count, header.station_count,
+            header.chunk_count, path, position);
+
+    if (file_size > 0) {
+        munmap((void *)memory, file_size);
+    }
+    free(directory);
+    free(ids);
+    free(tenths_column);
+    free(slot_ids);
+    free(sorted);
+}
+
+void invalid_columnar_file(const char *reason) {
+    fprintf(stderr, "Not a usable columnar file (%s), convert it with "
+                    "--convert first\n",
+            reason);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * The hot loop is a scatter into per station arrays: every row updates the
+ * slot its id picks, so consecutive rows rarely touch the same station and
+ * there is nothing left to parse or hash.
+ */
+void aggregate_columnar_chunk(const char *memory, const ColumnarChunk *chunk,
+                              uint32_t station_count, ColumnarTotals *totals) {
+    const uint16_t *ids = (const uint16_t *)(memory + chunk->offset);
+    const int16_t *tenths =
+        (const int16_t *)(memory + chunk->offset +
+                          align_columnar(chunk->rows * sizeof(uint16_t)));
+
+    /* Ids index the arrays and readings the histograms, so both are checked
+     * first, in a branch free pass the compiler vectorises. */
+    uint16_t max_id = 0;
+    int16_t min_value = 0;
+    int16_t max_value = 0;
+    for (uint32_t r = 0; r < chunk->rows; r++) {
+        max_id = ids[r] > max_id ? ids[r] : max_id;
+        min_value = tenths[r] < min_value ? tenths[r] : min_value;
+        max_value = tenths[r] > max_value ? tenths[r] : max_value;
+    }
+    if (max_id >= station_count) {
+        invalid_columnar_file("station id outside the dictionary");
+    }
+    if (totals->histograms != NULL &&
+        (min_value < -HISTOGRAM_OFFSET ||
+         max_value >= HISTOGRAM_BUCKETS - HISTOGRAM_OFFSET)) {
+        invalid_columnar_file("reading outside -99.9 to 99.9");
+    }
+
+    int64_t *sums = totals->sums;
+    uint64_t *counts = totals->counts;
+    int16_t *mins = totals->mins;
+    int16_t *maxes = totals->maxes;
+
+    for (uint32_t r = 0; r < chunk->rows; r++) {
+        uint16_t id = ids[r];
+        int16_t value = tenths[r];
+        sums[id] += value;
+        counts[id]++;
+        mins[id] = value < mins[id] ? value : mins[id];
+        maxes[id] = value > maxes[id] ? value : maxes[id];
+    }
+    if (totals->histograms != NULL) {
+        for (uint32_t r = 0; r < chunk->rows; r++) {
+            totals->histograms[(size_t)ids[r] * HISTOGRAM_BUCKETS + tenths[r] +
+                               HISTOGRAM_OFFSET]++;
+        }
+    }
+    COUNT(rows, chunk->rows);
+    COUNT(chunks, 1);
+    COUNT(bytes, chunk->rows * (sizeof(uint16_t) + sizeof(int16_t)));
+}
+
+void allocate_columnar_totals(ColumnarTotals *totals, uint32_t stations) {
+    totals->sums = calloc(stations, sizeof(int64_t));
+    totals->counts = calloc(stations, sizeof(uint64_t));
+    totals->mins = malloc(stations * sizeof(int16_t));
+    totals->maxes = malloc(stations * sizeof(int16_t));
+    for (uint32_t i = 0; i < stations; i++) {
+        totals->mins[i] = INT16_MAX;
+        totals->maxes[i] = INT16_MIN;
+    }
+    totals->histograms =
+        config.percentiles
+            ? calloc((size_t)stations * HISTOGRAM_BUCKETS, sizeof(uint32_t))
+            : NULL;
+}
+
+void free_columnar_totals(ColumnarTotals *totals) {
+    free(totals->sums);
+    free(totals->counts);
+    free(totals->mins);
+    free(totals->maxes);
+    free(totals->histograms);
+}
+
+void *process_columnar_chunks(void *threadarg) {
+    columnar_thread_data *my_data = (columnar_thread_data *)threadarg;
+    register_counters("worker", my_data->thread_id);
+    pin_current_thread(my_data->thread_id, config.threads);
+    allocate_columnar_totals(&my_data->totals, my_data->station_count);
+
+    for (;;) {
+        unsigned chunk = atomic_fetch_add(my_data->next_chunk, 1);
+        if (chunk >= my_data->chunk_count) {
+            break;
+        }
+        uint64_t started = trace_begin();
+        aggregate_columnar_chunk(my_data->memory, &my_data->chunks[chunk],
+                                 my_data->station_count, &my_data->totals);
+        trace_end(TRACE_PARSE, started);
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Checks that the dictionary and every chunk lie between the header and the
+ * directory, so the workers and the dictionary walk never read past them.
+ * Every subtraction is against a bound checked first, so none can wrap.
+ */
+void check_columnar_layout(const char *memory, const ColumnarHeader *header,
+                           const ColumnarChunk *chunks) {
+    if (header->station_count > MAX_COLUMNAR_STATIONS) {
+        invalid_columnar_file("too many stations");
+    }
+    if (header->dictionary_offset < sizeof(ColumnarHeader) ||
+        header->dictionary_offset > header->directory_offset) {
+        invalid_columnar_file("bad dictionary offset");
+    }
+
+    uint64_t position = header->dictionary_offset;
+    for (uint32_t s = 0; s < header->station_count; s++) {
+        uint16_t length;
+        if (header->directory_offset - position < sizeof(length)) {
+            invalid_columnar_file("truncated dictionary");
+        }
+        memcpy(&length, memory + position, sizeof(length));
+        position += sizeof(length);
+        if (length == 0 || header->directory_offset - position < length) {
+            invalid_columnar_file("bad dictionary entry");
+        }
+        position += length;
+    }
+
+    for (uint32_t c = 0; c < header->chunk_count; c++) {
+        const ColumnarChunk *chunk = &chunks[c];
+        uint64_t columns = 2 * align_columnar(chunk->rows * sizeof(uint16_t));
+        if (chunk->offset < position ||
+            chunk->offset % COLUMNAR_ALIGNMENT != 0 ||
+            chunk->offset > header->directory_offset ||
+            header->directory_offset - chunk->offset < columns) {
+            invalid_columnar_file("chunk outside the data");
+        }
+    }
+}
+
+/*
+ * Aggregates a --convert output. Workers claim chunks off a shared counter
+ * into private per station arrays, which are summed after the join and
+ * turned into a table keyed by the dictionary names for printing.
+ */
+HashTable *run_columnar(FILE *file, size_t file_size) {
+    if (file_size < sizeof(ColumnarHeader)) {
+        invalid_columnar_file("too short");
+    }
+    const char *memory = map_whole_file(file, file_size);
+    ColumnarHeader header;
+    memcpy(&header, memory, sizeof(header));
+    if (memcmp(header.magic, COLUMNAR_MAGIC, sizeof(header.magic)) != 0) {
+        invalid_columnar_file("bad magic");
+    }
+    if (header.directory_offset > file_size ||
+        (file_size - header.directory_offset) / sizeof(ColumnarChunk) <
+            header.chunk_count) {
+        invalid_columnar_file("truncated");
+    }
+    const ColumnarChunk *chunks =
+        (const ColumnarChunk *)(memory + header.directory_offset);
+    check_columnar_layout(memory, &header, chunks);
+
+    atomic_uint next_chunk = 0;
+    pthread_t *threads = malloc(sizeof(pthread_t) * config.threads);
+    columnar_thread_data *td =
+        malloc(sizeof(columnar_thread_data) * config.threads);
+    for (int i = 0; i < config.threads; i++) {
+        td[i].thread_id = i;
+        td[i].memory = memory;
+        td[i].chunks = chunks;
+        td[i].chunk_count = header.chunk_count;
+        td[i].station_count = header.station_count;
+        td[i].next_chunk = &next_chunk;
+
+        int rc =
+            pthread_create(&threads[i], NULL, process_columnar_chunks, &td[i]);
+        if (rc) {
+            printf("Error:unable to create thread, %d\n", rc);
+            exit(-1);
+        }
+    }
+
+    ColumnarTotals totals;
+    allocate_columnar_totals(&totals, header.station_count);
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            printf("ERROR : pthread join failed.\n");
+            exit(-1);
+        }
+        ColumnarTotals *own = &td[i].totals;
+        for (uint32_t s = 0; s < header.station_count; s++) {
+            totals.sums[s] += own->sums[s];
+            totals.counts[s] += own->counts[s];
+            totals.mins[s] = return_min(totals.mins[s], own->mins[s]);
+            totals.maxes[s] = return_max(totals.maxes[s], own->maxes[s]);
+        }
+        if (totals.histograms != NULL) {
+            size_t buckets = (size_t)header.station_count * HISTOGRAM_BUCKETS;
+            for (size_t b = 0; b < buckets; b++) {
+                totals.histograms[b] += own->histograms[b];
+            }
+        }
+        free_columnar_totals(own);
+    }
+
+    HashTable *table = create_table();
+    const char *name = memory + header.dictionary_offset;
+    for (uint32_t s = 0; s < header.station_count; s++) {
+        uint16_t length;
+        memcpy(&length, name, sizeof(length));
+        name += sizeof(length);
+        if (totals.counts[s] > 0) {
+            /* Short keys need INLINE_KEY_SIZE readable bytes. */
+            char padded_name[INLINE_KEY_SIZE] = {0};
+            const char *key = name;
+            if (length <= INLINE_KEY_SIZE) {
+                memcpy(padded_name, name, length);
+                key = padded_name;
+            }
+            Station station = {
+                .sum_temp = totals.sums[s],
+                .min_temp = totals.mins[s],
+                .max_temp = totals.maxes[s],
+                .count = totals.counts[s],
+            };
+            if (totals.histograms != NULL) {
+                station.histogram = allocate_histogram(table);
+                memcpy(station.histogram,
+                       totals.histograms + (size_t)s * HISTOGRAM_BUCKETS,
+                       HISTOGRAM_BUCKETS * sizeof(uint32_t));
+            }
+            ht_set(table, key, length, hash(key, length), &station);
+        }
+        name += length;
+    }
+
+    free_columnar_totals(&totals);
+    munmap((void *)memory, file_size);
+    free(threads);
+    free(td);
+    return table;
+}
+
+// +----------------+        +-----------------+       +------------------+
+// |  Reader Thread |        |      Queue      |       |   Worker Thread  |
+// +----------------+        +-----------------+       +------------------+
+// | - Maps a file  | -----> |- Enqueue line   | ----->| - Dequeue line   |
+// |   window       |        |  batches        |       |   batches        |
+// | - Splits it on |        |- Lock-free ring,|       | - Processes data |
+// |   newlines     |        |  backs off when |       | - Updates hash   |
+// | - Batches line |        |  full or empty  |       |   table          |
+// |   views        |        |- Closed when the|       | - Unmaps window  |
+// | - Marks itself |        |  last producer  |       | - Stops on NULL  |
+// |   done at EOF  |        |  is done        |       |   once drained   |
+// +----------------+        +-----------------+       +------------------+
+//
+
+/*
+ * Rows each shard received, so skew in the station mix shows up as an
+ * imbalance above 1.0. Per-shard and per-writer rows with --shard-stats.
+ */
+void print_shard_stats(writer_thread_data *writers) {
+    uint64_t min_rows = UINT64_MAX, max_rows = 0, total_rows = 0;
+    for (int c = 0; c < config.shards; c++) {
+        writer_thread_data *shard_writers =
+            &writers[c * config.writers_per_shard];
+        uint64_t rows = 0, batches = 0;
+        for (int i = 0; i < config.writers_per_shard; i++) {
+            rows += shard_writers[i].rows;
+            batches += shard_writers[i].batches;
+        }
+        min_rows = rows < min_rows ? rows : min_rows;
+        max_rows = rows > max_rows ? rows : max_rows;
+        total_rows += rows;
+
+        if (!config.shard_stats) {
+            continue;
+        }
+        fprintf(stderr, "Shard %d: %llu rows in %llu batches, writers", c,
+                (unsigned long long)rows, (unsigned long long)batches);
+        for (int i = 0; i < config.writers_per_shard; i++) {
+            fprintf(stderr, " %llu", (unsigned long long)shard_writers[i].rows);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    double mean_rows = (double)total_rows / config.shards;
+    fprintf(stderr,
+            "Shards: %d x %d writers, rows per shard %llu-%llu, imbalance "
+            "%.2f\n",
+            config.shards, config.writers_per_shard,
+            (unsigned long long)min_rows, (unsigned long long)max_rows,
+            mean_rows > 0 ? max_rows / mean_rows : 1.0);
+}
+
+
+HashTable *run_pipeline(FILE *file, size_t file_size) {
+    initialize_semaphores();
+    initialize_queues();
+    initialize_hash_tables();
+
+    pthread_t *reader_threads =
+        malloc(sizeof(pthread_t) * config.reader_threads);
+    struct reader_thread_data *reader_thread_data =
+        malloc(sizeof(struct reader_thread_data) * config.reader_threads);
+
+    int read_rc;
+    size_t file_mmap_offset = 0;
+
+    for (int i = 0; i < config.reader_threads; i++) {
         reader_thread_data[i].thread_id = i;
         reader_thread_data[i].file = file;
         reader_thread_data[i].file_size = file_size;
@@ -482,89 +3246,905 @@ int main(void) {
             printf("Error:unable to create thread, %d\n", read_rc);
             exit(-1);
         }
-
-        printf("Main: Created reader thread %d\n", i);
     }
 
     int write_rc;
-    int writer_threads_ids[NUMBER_OF_PARTITIONS *
-                           NUMBER_OF_WRITER_THREADS_PER_QUEUE];
-    pthread_t writer_threads[NUMBER_OF_PARTITIONS *
-                             NUMBER_OF_WRITER_THREADS_PER_QUEUE];
-    struct writer_thread_data
-        writer_thread_data[NUMBER_OF_PARTITIONS *
-                           NUMBER_OF_WRITER_THREADS_PER_QUEUE];
-
-    for (int c = 0; c < NUMBER_OF_PARTITIONS; c++) {
-        for (int i = 0; i < NUMBER_OF_WRITER_THREADS_PER_QUEUE; i++) {
-            /* Create writer threads per queue */
-            writer_thread_data[c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i]
-                .thread_id = c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i;
-            writer_thread_data[c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i]
-                .queue_letter = (char)(c + ALPHABET_START_CHAR);
-            writer_thread_data[c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i]
-                .table = tables[c];
-            writer_thread_data[c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i]
-                .finished_reader_threads = &finished_reader_threads;
-
-            write_rc = pthread_create(
-                &writer_threads[c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i],
-                NULL, insert_data_into_table,
-                (void *)&writer_thread_data
-                    [c * NUMBER_OF_WRITER_THREADS_PER_QUEUE + i]);
+    int number_of_writers = config.shards * config.writers_per_shard;
+    pthread_t *writer_threads = malloc(sizeof(pthread_t) * number_of_writers);
+    struct writer_thread_data *writer_thread_data =
+        malloc(sizeof(struct writer_thread_data) * number_of_writers);
+
+    for (int c = 0; c < config.shards; c++) {
+        for (int i = 0; i < config.writers_per_shard; i++) {
+            /* Create writer threads per shard */
+            int w = c * config.writers_per_shard + i;
+            writer_thread_data[w].thread_id = w;
+            writer_thread_data[w].shard = c;
+            writer_thread_data[w].rows = 0;
+            writer_thread_data[w].batches = 0;
+            writer_thread_data[w].table =
+                config.thread_local_tables ? NULL : tables[c];
+
+            write_rc = pthread_create(&writer_threads[w], NULL,
+                                      insert_data_into_table,
+                                      (void *)&writer_thread_data[w]);
 
             if (write_rc) {
                 printf("Error:unable to create thread, %d\n", write_rc);
                 exit(-1);
             }
-
-            /* printf("Main: Created writer thread %d for queue letter %c\n", c,
-             */
-            /*        c + ALPHABET_START_CHAR); */
         }
     }
 
-    bool continue_waiting = true;
-    void *ret;
-    for (int i = 0; i < NUMBER_OF_READER_THREADS; i++) {
-        if (pthread_join(reader_threads[i], &ret) != 0) {
+    for (int i = 0; i < config.reader_threads; i++) {
+        if (pthread_join(reader_threads[i], NULL) != 0) {
             printf("ERROR : pthread join failed.\n");
-            return (0);
+            exit(-1);
         }
-        /* printf("Main: Joined reader thread %d\n", i); */
     }
 
-    for (int i = 0;
-         i < NUMBER_OF_PARTITIONS * NUMBER_OF_WRITER_THREADS_PER_QUEUE; i++) {
-        if (pthread_join(writer_threads[i], &ret) != 0) {
+    for (int i = 0; i < number_of_writers; i++) {
+        if (pthread_join(writer_threads[i], NULL) != 0) {
             printf("ERROR : pthread join failed.\n");
-            return (0);
+            exit(-1);
         }
 
-        /* printf("Main: Joined Writer thread %d\n", i); */
+        if (config.thread_local_tables) {
+            merge_tables(tables[i / config.writers_per_shard],
+                         writer_thread_data[i].table);
+            free_table(writer_thread_data[i].table);
+        }
     }
 
-    printf("Final Station Data:\n");
-    exit(0);
+    print_shard_stats(writer_thread_data);
 
-    for (int t = 0; t < NUMBER_OF_PARTITIONS; t++) {
-        HashTable *table = tables[t];
+    /* Shards hold disjoint stations, merging only gathers them. */
+    HashTable *table = create_table();
+    for (int t = 0; t < config.shards; t++) {
+        merge_tables(table, tables[t]);
+        free_table(tables[t]);
+    }
+    free(tables);
 
-        for (int i = 0; i < TABLE_SIZE; i++) {
-            Entry *entry = table->entries[i];
-            while (entry != NULL) {
-                Station *s = entry->value;
-                printf("Station: %s, Avg Temp: %.2f, Min Temp: %.2f, Max Temp: "
-                       "%.2f, Count: %u\n",
-                       s->name, s->average_temp, s->min_temp, s->max_temp,
-                       s->count);
-                entry = entry->next; // advance
-            }
+    destroy_queues();
+    destroy_semaphores();
+    free(reader_threads);
+    free(reader_thread_data);
+    free(writer_threads);
+    free(writer_thread_data);
+    return table;
+}
+
+HashTable *run_engine(FILE *file, size_t file_size) {
+    switch (config.engine) {
+    case ENGINE_SEQUENTIAL:
+        return run_sequential(file, file_size);
+    case ENGINE_LOCKED:
+        return run_worker_threads(file, file_size, false);
+    case ENGINE_PIPELINE:
+        return run_pipeline(file, file_size);
+    case ENGINE_STATIC:
+        return run_static_ranges(file, 0, file_size);
+    case ENGINE_WORK_STEALING:
+        return run_work_stealing(file, file_size);
+    case ENGINE_STREAM:
+        return run_stream(file, is_regular_file(file) ? file_size : SIZE_MAX);
+    case ENGINE_URING:
+        return run_uring(file, file_size);
+    case ENGINE_COLUMNAR:
+        return run_columnar(file, file_size);
+    default:
+        return run_worker_threads(file, file_size, true);
+    }
+}
+
+/*
+ * Length of the input up to and including its last newline past `from`, so
+ * a line that is still being appended waits for the next run.
+ */
+size_t find_complete_length(int fd, size_t from, size_t size) {
+    char block[MAX_BUFFER_SIZE];
+    size_t end = size;
+    while (end > from) {
+        size_t length =
+            end - from < sizeof(block) ? end - from : sizeof(block);
+        size_t filled = pread_fully(fd, block, length, end - length);
+        const char *newline = find_last_newline(block, block + filled);
+        if (newline != NULL) {
+            return end - length + (newline - block) + 1;
+        }
+        end -= length;
+    }
+    return from;
+}
+
+void read_snapshot(FILE *in, void *data, size_t length, bool *ok) {
+    if (*ok && fread(data, 1, length, in) != length) {
+        *ok = false;
+    }
+}
+
+/*
+ * Loads --snapshot into `snapshot`, leaving its table NULL when there is
+ * none yet or it cannot be used; update_snapshot then starts from byte 0.
+ */
+void load_snapshot(const char *path, Snapshot *snapshot) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Ignoring snapshot %s: %s\n", path,
+                    strerror(errno));
+        }
+        return;
+    }
+
+    SnapshotHeader header;
+    bool ok = true;
+    read_snapshot(in, &header, sizeof(header), &ok);
+    if (!ok || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))) {
+        fprintf(stderr, "Ignoring snapshot %s: not a snapshot\n", path);
+        fclose(in);
+        return;
+    }
+    if ((bool)header.has_histograms != config.percentiles) {
+        fprintf(stderr, "Ignoring snapshot %s: saved %s --percentiles\n",
+                path, header.has_histograms ? "with" : "without");
+        fclose(in);
+        return;
+    }
+
+    HashTable *table = create_table();
+    /* Names are zero padded for the inline key compare. */
+    char *name = malloc(UINT16_MAX + INLINE_KEY_SIZE);
+    for (uint32_t i = 0; ok && i < header.station_count; i++) {
+        uint16_t length;
+        Station station = {0};
+        read_snapshot(in, &length, sizeof(length), &ok);
+        read_snapshot(in, name, length, &ok);
+        memset(name + length, 0, INLINE_KEY_SIZE);
+        read_snapshot(in, &station.sum_temp, sizeof(station.sum_temp), &ok);
+        read_snapshot(in, &station.min_temp, sizeof(station.min_temp), &ok);
+        read_snapshot(in, &station.max_temp, sizeof(station.max_temp), &ok);
+        read_snapshot(in, &station.count, sizeof(station.count), &ok);
+        if (header.has_histograms) {
+            station.histogram = allocate_histogram(table);
+            read_snapshot(in, station.histogram,
+                          HISTOGRAM_BUCKETS * sizeof(uint32_t), &ok);
+        }
+        if (ok) {
+            ht_set(table, name, length, hash(name, length), &station);
         }
+    }
+    free(name);
+    fclose(in);
 
+    if (!ok) {
+        fprintf(stderr, "Ignoring snapshot %s: truncated\n", path);
         free_table(table);
+        return;
+    }
+    snapshot->table = table;
+    snapshot->offset = header.offset;
+    snapshot->size = header.size;
+    snapshot->inode = header.inode;
+    snapshot->device = header.device;
+}
+
+void write_snapshot(FILE *out, const void *data, size_t length, bool *ok) {
+    if (*ok && fwrite(data, 1, length, out) != length) {
+        *ok = false;
+    }
+}
+
+/* Written next to `path` and renamed over it, so a crash keeps the old one. */
+void save_snapshot(const char *path, const Snapshot *snapshot) {
+    size_t path_length = strlen(path);
+    char *temporary_path = malloc(path_length + sizeof(".tmp"));
+    memcpy(temporary_path, path, path_length);
+    memcpy(temporary_path + path_length, ".tmp", sizeof(".tmp"));
+
+    FILE *out = fopen(temporary_path, "w");
+    if (out == NULL) {
+        perror("Error opening snapshot file");
+        exit(EXIT_FAILURE);
+    }
+
+    HashTable *table = snapshot->table;
+    SnapshotHeader header = {
+        .offset = snapshot->offset,
+        .size = snapshot->size,
+        .inode = snapshot->inode,
+        .device = snapshot->device,
+        .station_count = table->count,
+        .has_histograms = config.percentiles,
+    };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    bool ok = true;
+    write_snapshot(out, &header, sizeof(header), &ok);
+    for (size_t i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key_length == 0) {
+            continue;
+        }
+        Station *station = &entry->value;
+        uint16_t length = entry->key_length;
+        write_snapshot(out, &length, sizeof(length), &ok);
+        write_snapshot(out, entry_key(entry), length, &ok);
+        write_snapshot(out, &station->sum_temp, sizeof(station->sum_temp),
+                       &ok);
+        write_snapshot(out, &station->min_temp, sizeof(station->min_temp),
+                       &ok);
+        write_snapshot(out, &station->max_temp, sizeof(station->max_temp),
+                       &ok);
+        write_snapshot(out, &station->count, sizeof(station->count), &ok);
+        if (station->histogram != NULL) {
+            write_snapshot(out, station->histogram,
+                           HISTOGRAM_BUCKETS * sizeof(uint32_t), &ok);
+        }
+    }
+
+    if (fclose(out) != 0 || !ok || rename(temporary_path, path) != 0) {
+        perror("Error writing snapshot file");
+        exit(EXIT_FAILURE);
+    }
+    free(temporary_path);
+}
+
+/*
+ * Brings `snapshot` up to the complete lines of `file`. A snapshot of
+ * another file, or of one that shrank since, is dropped and the file is
+ * aggregated from the start with the selected engine; otherwise only the
+ * appended lines are parsed, by the static engine over just that range, and
+ * merged in. Returns false when nothing new was parsed.
+ */
+bool update_snapshot(FILE *file, Snapshot *snapshot) {
+    struct stat status;
+    if (fstat(fileno(file), &status) != 0) {
+        perror("Error reading file status");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = status.st_size;
+
+    if (snapshot->table != NULL) {
+        /* A rotated file may well be smaller too, so check identity first. */
+        const char *reason = NULL;
+        if (snapshot->inode != (uint64_t)status.st_ino ||
+            snapshot->device != (uint64_t)status.st_dev) {
+            reason = "file was replaced";
+        } else if (size < snapshot->size) {
+            reason = "file shrank";
+        }
+        if (reason != NULL) {
+            fprintf(stderr, "Snapshot: %s, parsing from the start\n", reason);
+            free_table(snapshot->table);
+            snapshot->table = NULL;
+        }
+    }
+    if (snapshot->table == NULL) {
+        snapshot->offset = 0;
+    }
+
+    size_t end = find_complete_length(fileno(file), snapshot->offset, size);
+    bool parsed = snapshot->table == NULL || end > snapshot->offset;
+    if (snapshot->table == NULL) {
+        snapshot->table = run_engine(file, end);
+    } else if (end > snapshot->offset) {
+        fprintf(stderr, "Snapshot: parsing %zu appended bytes from %zu\n",
+                end - snapshot->offset, snapshot->offset);
+        HashTable *tail = run_static_ranges(file, snapshot->offset, end);
+        merge_tables(snapshot->table, tail);
+        free_table(tail);
+    }
+
+    snapshot->offset = end;
+    snapshot->size = size;
+    snapshot->inode = status.st_ino;
+    snapshot->device = status.st_dev;
+    return parsed;
+}
+
+/*
+ * --follow: polls the input path for appended lines, printing refreshed
+ * results and saving the snapshot after every change. The path is reopened
+ * each time so a rotated file is noticed as a replacement.
+ */
+void follow_input(Snapshot *snapshot) {
+    struct timespec interval = {
+        .tv_sec = (time_t)config.follow_interval,
+        .tv_nsec = (long)((config.follow_interval -
+                           (time_t)config.follow_interval) *
+                          1e9),
+    };
+    for (;;) {
+        nanosleep(&interval, NULL);
+        FILE *file = fopen(config.input_path, "r");
+        if (file == NULL) {
+            /* Between a rotation's rename and create, try again later. */
+            continue;
+        }
+        reset_counters();
+        if (update_snapshot(file, snapshot)) {
+            print_results(snapshot->table);
+            if (config.snapshot_path != NULL) {
+                save_snapshot(config.snapshot_path, snapshot);
+            }
+        }
+        fclose(file);
+    }
+}
+
+/* Sums every slot into `total`, returns how many slots were claimed. */
+int sum_counters(ThreadCounters *total) {
+    int slots = atomic_load(&counted_threads);
+    if (slots > MAX_COUNTED_THREADS) {
+        slots = MAX_COUNTED_THREADS;
+    }
+    *total = (ThreadCounters){.role = "total"};
+    for (int i = 0; i < slots; i++) {
+        total->rows += thread_counters[i].rows;
+        total->bytes += thread_counters[i].bytes;
+        total->chunks += thread_counters[i].chunks;
+        total->wait_ns += thread_counters[i].wait_ns;
+        total->probes += thread_counters[i].probes;
+        total->collisions += thread_counters[i].collisions;
+        total->inserts += thread_counters[i].inserts;
+    }
+    return slots;
+}
+
+void print_counter_row(const ThreadCounters *c) {
+    fprintf(stderr, "%-8s %4d %12llu %10.1f %7llu %10.1f %12llu %11llu %8llu\n",
+            c->role, c->thread_id, (unsigned long long)c->rows,
+            c->bytes / 1048576.0, (unsigned long long)c->chunks,
+            c->wait_ns / 1e6, (unsigned long long)c->probes,
+            (unsigned long long)c->collisions, (unsigned long long)c->inserts);
+}
+
+/*
+ * End of run report: a thread that parsed few rows while waiting long
+ * points at the stage starving it, probes per row at the table.
+ */
+void print_counters(uint64_t elapsed_ns) {
+    ThreadCounters total;
+    int slots = sum_counters(&total);
+
+    fprintf(stderr, "%-8s %4s %12s %10s %7s %10s %12s %11s %8s\n", "thread",
+            "id", "rows", "MB", "chunks", "wait ms", "probes", "collisions",
+            "inserts");
+    for (int i = 0; i < slots; i++) {
+        if (i == 0 && thread_counters[0].rows == 0 &&
+            thread_counters[0].probes == 0) {
+            /* The main thread only shows up when it parsed or merged. */
+            continue;
+        }
+        print_counter_row(&thread_counters[i]);
+    }
+    /* The total's id is the number of threads that registered. */
+    total.thread_id = slots - 1;
+    print_counter_row(&total);
+    int unreported = atomic_load(&counted_threads) - slots;
+    if (unreported > 0) {
+        fprintf(stderr, "%d threads past the first %d were not counted\n",
+                unreported, MAX_COUNTED_THREADS);
+    }
+
+    double seconds = elapsed_ns / 1e9;
+    fprintf(stderr,
+            "Elapsed %.3f s, %.1f M rows/s, %.2f GB/s, %.2f probes per row\n",
+            seconds, seconds > 0 ? total.rows / seconds / 1e6 : 0.0,
+            seconds > 0 ? total.bytes / seconds / 1e9 : 0.0,
+            total.rows > 0 ? (double)total.probes / total.rows : 0.0);
+}
+
+void write_counter_json(FILE *out, const ThreadCounters *c) {
+    fprintf(out,
+            "{\"role\": \"%s\", \"id\": %d, \"rows\": %llu, \"bytes\": "
+            "%llu, \"chunks\": %llu, \"wait_ns\": %llu, \"probes\": %llu, "
+            "\"collisions\": %llu, \"inserts\": %llu}",
+            c->role, c->thread_id, (unsigned long long)c->rows,
+            (unsigned long long)c->bytes, (unsigned long long)c->chunks,
+            (unsigned long long)c->wait_ns, (unsigned long long)c->probes,
+            (unsigned long long)c->collisions, (unsigned long long)c->inserts);
+}
+
+void write_counters_json(const char *path, uint64_t elapsed_ns) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("Error opening stats file");
+        exit(EXIT_FAILURE);
+    }
+
+    ThreadCounters total;
+    int slots = sum_counters(&total);
+    total.thread_id = slots - 1;
+
+    fprintf(out, "{\"engine\": \"%s\", \"elapsed_ns\": %llu, \"total\": ",
+            engine_names[config.engine], (unsigned long long)elapsed_ns);
+    write_counter_json(out, &total);
+    fprintf(out, ",\n \"threads\": [");
+    for (int i = 0; i < slots; i++) {
+        fprintf(out, "%s\n  ", i == 0 ? "" : ",");
+        write_counter_json(out, &thread_counters[i]);
+    }
+    fprintf(out, "]}\n");
+
+    if (fclose(out) != 0) {
+        perror("Error writing stats file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void initialize_tracing() {
+    trace_origin_ns = now_ns();
+    trace_rings[0] = calloc(1, sizeof(TraceRing));
+    trace_ring = trace_rings[0];
+}
+
+/*
+ * Chrome trace event JSON, loads in chrome://tracing and Perfetto. Every
+ * span becomes a complete ("X") event on its thread's track, timestamps in
+ * microseconds since initialize_tracing.
+ */
+void write_trace(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("Error opening trace file");
+        exit(EXIT_FAILURE);
+    }
+
+    int slots = atomic_load(&counted_threads);
+    if (slots > MAX_COUNTED_THREADS) {
+        slots = MAX_COUNTED_THREADS;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+                 "\"args\": {\"name\": \"%s\"}}",
+            engine_names[config.engine]);
+    uint64_t dropped = 0;
+    for (int t = 0; t < slots; t++) {
+        TraceRing *ring = trace_rings[t];
+        if (ring == NULL) {
+            continue;
+        }
+        fprintf(out,
+                ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                "\"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                t, thread_counters[t].role, thread_counters[t].thread_id);
+
+        uint64_t first = 0;
+        if (ring->recorded > TRACE_RING_SIZE) {
+            first = ring->recorded - TRACE_RING_SIZE;
+            dropped += first;
+        }
+        for (uint64_t e = first; e < ring->recorded; e++) {
+            TraceEvent *event = &ring->events[e % TRACE_RING_SIZE];
+            fprintf(out,
+                    ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    trace_event_names[event->type], t,
+                    (event->start_ns - trace_origin_ns) / 1e3,
+                    (event->end_ns - event->start_ns) / 1e3);
+        }
+        free(ring);
+        trace_rings[t] = NULL;
+    }
+    /* Slot 0 was this thread's own ring, which --follow keeps using. */
+    trace_ring = NULL;
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0) {
+        perror("Error writing trace file");
+        exit(EXIT_FAILURE);
+    }
+    /* Threads started later, e.g. by --follow, record nothing. */
+    config.trace_path = NULL;
+    fprintf(stderr, "Trace written to %s", path);
+    if (dropped > 0) {
+        fprintf(stderr, ", oldest %llu events overwritten",
+                (unsigned long long)dropped);
+    }
+    fprintf(stderr, "\n");
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [FILE]\n\n", program);
+    fprintf(stderr, "Aggregates min/mean/max per station of FILE (default "
+                    "%s).\n"
+                    "FILE may be %s for stdin; pipes and FIFOs always use the "
+                    "%s engine.\n\n",
+            DEFAULT_INPUT_PATH, STDIN_PATH, engine_names[ENGINE_STREAM]);
+    fprintf(stderr, "  -e, --engine NAME          one of");
+    for (size_t e = 0; e < NUMBER_OF_ENGINES; e++) {
+        fprintf(stderr, " %s", engine_names[e]);
+    }
+    fprintf(stderr, "\n                             (default %s)\n",
+            engine_names[ENGINE_THREAD_LOCAL]);
+    fprintf(stderr,
+            "  -t, --threads N            worker threads (default: online "
+            "CPUs)\n"
+            "  -c, --chunk-size BYTES     bytes per mapped window, K/M/G\n"
+            "                             suffixes allowed (default 200M)\n"
+            "  -m, --morsel-size BYTES    work-stealing, stream and uring "
+            "unit of\n"
+            "                             work (default 4M)\n"
+            "      --direct               uring reads bypass the page cache "
+            "with\n"
+            "                             O_DIRECT\n"
+            "      --madvise ADVICE       normal, sequential or willneed for "
+            "every\n"
+            "                             mapping of FILE (default normal)\n"
+            "      --populate             prefault mappings with "
+            "MAP_POPULATE\n"
+            "      --release              drop consumed pages with "
+            "MADV_DONTNEED\n"
+            "      --huge-pages           put hash tables on transparent huge "
+            "pages\n"
+            "      --pin                  pin threads to CPUs grouped by NUMA "
+            "node,\n"
+            "                             private tables are created on the "
+            "worker's\n"
+            "                             node\n"
+            "  -r, --readers N            pipeline reader threads (default "
+            "%d)\n"
+            "  -s, --shards N             pipeline hash shards (default: "
+            "--threads)\n"
+            "  -w, --writers-per-shard N  pipeline writers per shard (default "
+            "%d)\n"
+            "      --shared-tables        pipeline writers of a shard share "
+            "one\n"
+            "                             locked table\n"
+            "      --shard-stats          print rows per pipeline shard and "
+            "writer\n"
+            "      --stats                print per-thread rows, bytes, waits "
+            "and\n"
+            "                             table probes at the end\n"
+            "      --stats-json FILE      write the same counters as JSON\n"
+            "      --convert OUT          write FILE as a columnar file for "
+            "the\n"
+            "                             %s engine instead of printing "
+            "results\n"
+            "      --snapshot PATH        resume from the aggregates saved in "
+            "PATH\n"
+            "                             and parse only lines appended "
+            "since\n"
+            "      --follow SECONDS       keep polling FILE for appended "
+            "lines and\n"
+            "                             print refreshed results\n"
+            "      --percentiles          also print the exact median, p90 "
+            "and p99\n"
+            "                             of every station\n"
+            "      --trace FILE           write mmap, read, parse, queue, lock "
+            "and\n"
+            "                             merge spans of every thread as "
+            "Chrome\n"
+            "                             trace JSON\n"
+            "  -h, --help                 show this help\n",
+            NUMBER_OF_READER_THREADS, NUMBER_OF_WRITER_THREADS_PER_SHARD,
+            engine_names[ENGINE_COLUMNAR]);
+}
+
+/* Parses a byte count with an optional K, M or G suffix, 0 on error. */
+size_t parse_size(const char *text) {
+    char *suffix;
+    unsigned long long value = strtoull(text, &suffix, 10);
+    switch (*suffix) {
+    case 'k':
+    case 'K':
+        value <<= 10;
+        suffix++;
+        break;
+    case 'm':
+    case 'M':
+        value <<= 20;
+        suffix++;
+        break;
+    case 'g':
+    case 'G':
+        value <<= 30;
+        suffix++;
+        break;
+    }
+    if (suffix == text || *suffix != '\0') {
+        return 0;
+    }
+    return value;
+}
+
+/* `what` names the option's value in the error, e.g. "shard count". */
+int parse_positive_int(const char *text, const char *what,
+                       const char *program) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < 1 || value > 4096) {
+        fprintf(stderr, "Invalid %s: %s\n", what, text);
+        print_usage(program);
+        exit(EXIT_FAILURE);
+    }
+    return (int)value;
+}
+
+enum {
+    OPTION_SHARED_TABLES = 256,
+    OPTION_DIRECT,
+    OPTION_MADVISE,
+    OPTION_POPULATE,
+    OPTION_RELEASE,
+    OPTION_HUGE_PAGES,
+    OPTION_PIN,
+    OPTION_SHARD_STATS,
+    OPTION_STATS,
+    OPTION_STATS_JSON,
+    OPTION_TRACE,
+    OPTION_PERCENTILES,
+    OPTION_CONVERT,
+    OPTION_SNAPSHOT,
+    OPTION_FOLLOW,
+};
+
+void parse_arguments(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"engine", required_argument, NULL, 'e'},
+        {"threads", required_argument, NULL, 't'},
+        {"chunk-size", required_argument, NULL, 'c'},
+        {"morsel-size", required_argument, NULL, 'm'},
+        {"readers", required_argument, NULL, 'r'},
+        {"shards", required_argument, NULL, 's'},
+        {"writers-per-shard", required_argument, NULL, 'w'},
+        /* The name from when the pipeline had one queue per letter. */
+        {"writers-per-queue", required_argument, NULL, 'w'},
+        {"shared-tables", no_argument, NULL, OPTION_SHARED_TABLES},
+        {"shard-stats", no_argument, NULL, OPTION_SHARD_STATS},
+        {"stats", no_argument, NULL, OPTION_STATS},
+        {"stats-json", required_argument, NULL, OPTION_STATS_JSON},
+        {"trace", required_argument, NULL, OPTION_TRACE},
+        {"percentiles", no_argument, NULL, OPTION_PERCENTILES},
+        {"convert", required_argument, NULL, OPTION_CONVERT},
+        {"snapshot", required_argument, NULL, OPTION_SNAPSHOT},
+        {"follow", required_argument, NULL, OPTION_FOLLOW},
+        {"direct", no_argument, NULL, OPTION_DIRECT},
+        {"madvise", required_argument, NULL, OPTION_MADVISE},
+        {"populate", no_argument, NULL, OPTION_POPULATE},
+        {"release", no_argument, NULL, OPTION_RELEASE},
+        {"huge-pages", no_argument, NULL, OPTION_HUGE_PAGES},
+        {"pin", no_argument, NULL, OPTION_PIN},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    config.threads = online_cpus > 0 ? (int)online_cpus : 1;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "e:t:c:m:r:s:w:h", long_options,
+                                 NULL)) != -1) {
+        switch (option) {
+        case 'e': {
+            size_t e = 0;
+            while (e < NUMBER_OF_ENGINES && strcmp(engine_names[e], optarg)) {
+                e++;
+            }
+            if (e == NUMBER_OF_ENGINES) {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            config.engine = e;
+            break;
+        }
+        case 't':
+            config.threads =
+                parse_positive_int(optarg, "thread count", argv[0]);
+            break;
+        case 'c':
+            config.chunk_size = parse_size(optarg);
+            if (config.chunk_size == 0) {
+                fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            config.morsel_size = parse_size(optarg);
+            if (config.morsel_size == 0) {
+                fprintf(stderr, "Invalid morsel size: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            config.reader_threads =
+                parse_positive_int(optarg, "reader count", argv[0]);
+            break;
+        case 's':
+            config.shards =
+                parse_positive_int(optarg, "shard count", argv[0]);
+            break;
+        case 'w':
+            config.writers_per_shard =
+                parse_positive_int(optarg, "writers per shard", argv[0]);
+            break;
+        case OPTION_SHARED_TABLES:
+            config.thread_local_tables = false;
+            break;
+        case OPTION_DIRECT:
+            config.direct_io = true;
+            break;
+        case OPTION_MADVISE: {
+            size_t a = 0;
+            while (a < NUMBER_OF_MAPPING_ADVICES &&
+                   strcmp(mapping_advices[a].name, optarg)) {
+                a++;
+            }
+            if (a == NUMBER_OF_MAPPING_ADVICES) {
+                fprintf(stderr, "Unknown advice: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            config.mapping_advice = mapping_advices[a].advice;
+            break;
+        }
+        case OPTION_POPULATE:
+            config.populate = true;
+            break;
+        case OPTION_RELEASE:
+            config.release_pages = true;
+            break;
+        case OPTION_HUGE_PAGES:
+            config.huge_pages = true;
+            break;
+        case OPTION_PIN:
+            config.pin_threads = true;
+            break;
+        case OPTION_SHARD_STATS:
+            config.shard_stats = true;
+            break;
+        case OPTION_STATS:
+            config.print_stats = true;
+            break;
+        case OPTION_STATS_JSON:
+            config.stats_json_path = optarg;
+            break;
+        case OPTION_TRACE:
+            config.trace_path = optarg;
+            break;
+        case OPTION_PERCENTILES:
+            config.percentiles = true;
+            break;
+        case OPTION_CONVERT:
+            config.convert_path = optarg;
+            break;
+        case OPTION_SNAPSHOT:
+            config.snapshot_path = optarg;
+            break;
+        case OPTION_FOLLOW: {
+            char *rest;
+            config.follow_interval = strtod(optarg, &rest);
+            if (rest == optarg || *rest != '\0' ||
+                !(config.follow_interval > 0)) {
+                fprintf(stderr, "Invalid follow interval: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'h':
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        config.input_path = argv[optind++];
+    }
+    if (optind < argc) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.shards == 0) {
+        config.shards = config.threads;
+    }
+    if (config.convert_path != NULL && config.engine == ENGINE_COLUMNAR) {
+        fprintf(stderr, "--convert reads text, not a columnar file\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((config.snapshot_path != NULL || config.follow_interval > 0) &&
+        (config.convert_path != NULL || config.engine == ENGINE_COLUMNAR)) {
+        fprintf(stderr, "--snapshot and --follow work on text input only\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!ENABLE_COUNTERS && (config.print_stats || config.stats_json_path)) {
+        fprintf(stderr, "Counters were compiled out (ENABLE_COUNTERS 0)\n");
+        config.print_stats = false;
+        config.stats_json_path = NULL;
+    }
+
+    /* Window offsets have to stay page aligned for mmap. */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    config.chunk_size =
+        (config.chunk_size + page_size - 1) / page_size * page_size;
+    /* And read offsets block aligned for O_DIRECT. */
+    config.morsel_size = (config.morsel_size + DIRECT_IO_ALIGNMENT - 1) /
+                         DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+}
+
+int main(int argc, char **argv) {
+    parse_arguments(argc, argv);
+
+    FILE *file = open_file(config.input_path);
+
+    size_t file_size = get_file_size(file);
+    if (is_regular_file(file)) {
+        fprintf(stderr, "File size: %llu bytes\n",
+                (unsigned long long)file_size);
+    } else if (config.convert_path != NULL ||
+               config.engine == ENGINE_COLUMNAR) {
+        fprintf(stderr, "Columnar files are mapped, FILE has to be a regular "
+                        "file\n");
+        exit(EXIT_FAILURE);
+    } else if (config.snapshot_path != NULL || config.follow_interval > 0) {
+        fprintf(stderr, "Snapshots resume at a byte offset, FILE has to be a "
+                        "regular file\n");
+        exit(EXIT_FAILURE);
+    } else {
+        fprintf(stderr, "File size: unknown, streaming\n");
+        config.engine = ENGINE_STREAM;
+    }
+
+    initialize_scanner();
+    fprintf(stderr, "Delimiter scanner: %s\n", get_scanner_name());
+    if (config.pin_threads) {
+        initialize_placement();
+    }
+    fprintf(stderr, "Engine: %s\n", engine_names[config.engine]);
+    if (config.trace_path != NULL) {
+        initialize_tracing();
+    }
+
+    uint64_t started = now_ns();
+    HashTable *table;
+    Snapshot snapshot;
+    if (config.snapshot_path != NULL || config.follow_interval > 0) {
+        snapshot.table = NULL;
+        if (config.snapshot_path != NULL) {
+            load_snapshot(config.snapshot_path, &snapshot);
+        }
+        update_snapshot(file, &snapshot);
+        table = snapshot.table;
+    } else {
+        table = run_engine(file, file_size);
+    }
+
+    if (config.convert_path != NULL) {
+        convert_to_columnar(file, file_size, table, config.convert_path);
+    } else {
+        print_results(table);
+    }
+    if (config.snapshot_path != NULL) {
+        save_snapshot(config.snapshot_path, &snapshot);
+    }
+
+    uint64_t elapsed_ns = now_ns() - started;
+    if (config.print_stats) {
+        print_counters(elapsed_ns);
+    }
+    if (config.stats_json_path != NULL) {
+        write_counters_json(config.stats_json_path, elapsed_ns);
+    }
+    if (config.trace_path != NULL) {
+        write_trace(config.trace_path);
+    }
+    if (config.follow_interval > 0) {
+        fclose(file);
+        follow_input(&snapshot);
     }
 
+    free_table(table);
     fclose(file);
     return 0;
 }
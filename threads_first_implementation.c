@@ -2,31 +2,75 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define TABLE_SIZE 50000000
+/* Comfortably above the ~10k distinct stations, grows if ever exceeded. */
+#define INITIAL_TABLE_CAPACITY 16384
+#define ARENA_BLOCK_SIZE ((size_t)1024 * 1024)
 #define NUMBER_OF_THREADS 16
+/*
+ * Each thread aggregates into its own table without taking table_semaphore,
+ * the tables are merged in thread order after the join.
+ */
+#define USE_THREAD_LOCAL_TABLES 1
+/*
+ * Per-row progress lines. They go through stdout, which serializes every
+ * thread on its lock, so keep them off unless chasing a bug.
+ */
+#define ENABLE_DEBUG_PRINTS 0
+
+#define debug_print(...)                                                       \
+    do {                                                                       \
+        if (ENABLE_DEBUG_PRINTS) {                                             \
+            printf(__VA_ARGS__);                                               \
+        }                                                                      \
+    } while (0)
 
 typedef struct Station {
-    char name[50];
-    float average_temp;
-    float min_temp;
-    float max_temp;
-    float median_temp;
-    unsigned int count;
+    /* Tenths of a degree, the mean is only computed when printing. */
+    int64_t sum_temp;
+    int32_t min_temp;
+    int32_t max_temp;
+    uint64_t count;
 } Station;
 
+/*
+ * Open addressing with linear probing. The aggregates live inline in the
+ * slots, and the capacity is a power of two so the probe index is a mask of
+ * the hash.
+ */
 typedef struct Entry {
     char *key;
-    Station *value;
-    struct Entry *next;
+    uint32_t hash;
+    uint32_t key_length;
+    Station value;
 } Entry;
 
+/*
+ * Bump allocator owning the keys of one table, so a new station costs a
+ * pointer bump instead of a malloc and teardown frees a few blocks instead
+ * of walking every slot.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *blocks;
+    char *cursor;
+    char *limit;
+} Arena;
+
 typedef struct HashTable {
-    Entry **entries;
+    Entry *entries;
+    size_t capacity;
+    size_t count;
+    Arena keys;
 } HashTable;
 
 typedef struct thread_data {
@@ -60,73 +104,366 @@ char *get_semaphore_name(int semaphore_type) {
     }
 }
 
-unsigned int hash(const char *key) {
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *key++)) {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+#define HASH_SEED 0x9747b28cULL
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t load_word(const char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t hash_word(uint64_t state, uint64_t word) {
+    state = (state ^ word) * HASH_MULTIPLIER;
+    return state ^ (state >> 29);
+}
+
+/* Hashes the name eight bytes at a time, the last word zero padded. */
+uint32_t hash(const char *key, size_t length) {
+    uint64_t state = HASH_SEED;
+    size_t offset = 0;
+    for (; offset + 8 <= length; offset += 8) {
+        state = hash_word(state, load_word(key + offset));
+    }
+    if (offset < length) {
+        uint64_t word = 0;
+        memcpy(&word, key + offset, length - offset);
+        state = hash_word(state, word);
+    }
+    state ^= state >> 32;
+    state *= HASH_MULTIPLIER;
+    return (uint32_t)(state >> 32);
+}
+
+/* Length first, then the first 16 bytes a word at a time, then the rest. */
+static inline bool key_equals(const char *stored, const char *key,
+                              size_t key_length) {
+    size_t offset = 0;
+    for (; offset < 16 && offset + 8 <= key_length; offset += 8) {
+        if (load_word(stored + offset) != load_word(key + offset)) {
+            return false;
+        }
+    }
+    return memcmp(stored + offset, key + offset, key_length - offset) == 0;
+}
+
+void *arena_allocate(Arena *arena, size_t size) {
+    if ((size_t)(arena->limit - arena->cursor) < size) {
+        size_t block_size = sizeof(ArenaBlock) + size > ARENA_BLOCK_SIZE
+                                ? sizeof(ArenaBlock) + size
+                                : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = malloc(block_size);
+        block->next = arena->blocks;
+        block->size = block_size;
+        arena->blocks = block;
+        arena->cursor = (char *)(block + 1);
+        arena->limit = (char *)block + block_size;
+    }
+    void *memory = arena->cursor;
+    arena->cursor += size;
+    return memory;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
     }
-    return hash % TABLE_SIZE;
 }
 
 HashTable *create_table() {
     HashTable *table = malloc(sizeof(HashTable));
-    table->entries = calloc(TABLE_SIZE, sizeof(Entry *));
+    table->entries = calloc(INITIAL_TABLE_CAPACITY, sizeof(Entry));
+    table->capacity = INITIAL_TABLE_CAPACITY;
+    table->count = 0;
+    table->keys = (Arena){0};
     return table;
 }
 
 void free_table(HashTable *table) {
+    arena_free(&table->keys);
+    free(table->entries);
+    free(table);
+}
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        Entry *entry = table->entries[i];
-        while (entry != NULL) {
-            Entry *next = entry->next;
-            free(entry->key);
-            free(entry);
-            entry = next;
+/* Finds the slot holding `key`, or the empty slot where it belongs. */
+Entry *ht_find_slot(HashTable *table, const char *key, size_t key_length,
+                    uint32_t key_hash) {
+    size_t mask = table->capacity - 1;
+    size_t index = key_hash & mask;
+    for (;;) {
+        Entry *entry = &table->entries[index];
+        if (entry->key == NULL) {
+            return entry;
+        }
+        if (entry->hash == key_hash && entry->key_length == key_length &&
+            key_equals(entry->key, key, key_length)) {
+            return entry;
         }
+        index = (index + 1) & mask;
     }
-    free(table->entries);
-    free(table);
 }
 
-void ht_set(HashTable *table, const char *key, Station *value) {
-    unsigned int index = hash(key);
-    Entry *entry = table->entries[index];
+void ht_grow(HashTable *table) {
+    Entry *old_entries = table->entries;
+    size_t old_capacity = table->capacity;
+
+    table->capacity = old_capacity * 2;
+    table->entries = calloc(table->capacity, sizeof(Entry));
 
-    for (Entry *e = entry; e != NULL; e = e->next) {
-        if (strcmp(e->key, key) == 0) {
-            e->value = value;
-            return;
+    size_t mask = table->capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].key == NULL) {
+            continue;
+        }
+        size_t index = old_entries[i].hash & mask;
+        while (table->entries[index].key != NULL) {
+            index = (index + 1) & mask;
         }
+        table->entries[index] = old_entries[i];
+    }
+    free(old_entries);
+}
+
+void ht_set(HashTable *table, const char *key, size_t key_length,
+            Station *value) {
+    uint32_t key_hash = hash(key, key_length);
+    Entry *entry = ht_find_slot(table, key, key_length, key_hash);
+
+    if (entry->key != NULL) {
+        entry->value = *value;
+        return;
+    }
+
+    if ((table->count + 1) * 2 > table->capacity) {
+        ht_grow(table);
+        entry = ht_find_slot(table, key, key_length, key_hash);
     }
 
-    Entry *new_entry = malloc(sizeof(Entry));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    new_entry->next = entry;
-    table->entries[index] = new_entry;
+    entry->key = arena_allocate(&table->keys, key_length + 1);
+    memcpy(entry->key, key, key_length);
+    entry->key[key_length] = '\0';
+    entry->hash = key_hash;
+    entry->key_length = key_length;
+    entry->value = *value;
+    table->count++;
 }
 
-Station *ht_get(HashTable *table, const char *key) {
-    unsigned int index = hash(key);
-    Entry *entry = table->entries[index];
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            return entry->value;
+Station *ht_get(HashTable *table, const char *key, size_t key_length) {
+    Entry *entry = ht_find_slot(table, key, key_length, hash(key, key_length));
+    return entry->key == NULL ? NULL : &entry->value;
+}
+
+/*
+ * Rounds sum / count half up (floor(x + 0.5)), the rounding the challenge
+ * reference output uses for the mean.
+ */
+int64_t round_mean(int64_t sum, uint64_t count) {
+    int64_t numerator = 2 * sum + (int64_t)count;
+    int64_t denominator = 2 * (int64_t)count;
+    int64_t quotient = numerator / denominator;
+    if (numerator % denominator != 0 && numerator < 0) {
+        quotient--;
+    }
+    return quotient;
+}
+
+/* Writes tenths of a degree as -?d+.d, returns the number of bytes. */
+size_t format_tenths(char *out, int64_t tenths) {
+    size_t length = 0;
+    if (tenths < 0) {
+        out[length++] = '-';
+        tenths = -tenths;
+    }
+    if (tenths >= 100) {
+        out[length++] = '0' + tenths / 100;
+    }
+    out[length++] = '0' + (tenths / 10) % 10;
+    out[length++] = '.';
+    out[length++] = '0' + tenths % 10;
+    return length;
+}
+
+/* Orders by the raw UTF-8 bytes of the name, i.e. by code point. */
+int compare_entries(const void *a, const void *b) {
+    const Entry *left = *(const Entry *const *)a;
+    const Entry *right = *(const Entry *const *)b;
+    size_t length = left->key_length < right->key_length ? left->key_length
+                                                         : right->key_length;
+    int result = memcmp(left->key, right->key, length);
+    if (result != 0) {
+        return result;
+    }
+    return (left->key_length > right->key_length) -
+           (left->key_length < right->key_length);
+}
+
+/*
+ * Prints {name=min/mean/max, ...} sorted by name. The whole line is
+ * formatted into one buffer sized up front and handed to a single write.
+ */
+void print_results(HashTable *table) {
+    Entry **sorted = malloc(sizeof(Entry *) * (table->count + 1));
+    size_t count = 0;
+    size_t buffer_size = 3;
+    for (size_t i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL) {
+            continue;
+        }
+        sorted[count++] = entry;
+        /* name, '=', three values of at most 5 bytes, two '/', ", " */
+        buffer_size += entry->key_length + 1 + 3 * 5 + 2 + 2;
+    }
+    qsort(sorted, count, sizeof(Entry *), compare_entries);
+
+    char *buffer = malloc(buffer_size);
+    size_t used = 0;
+    buffer[used++] = '{';
+    for (size_t i = 0; i < count; i++) {
+        Entry *entry = sorted[i];
+        Station *s = &entry->value;
+        if (i > 0) {
+            buffer[used++] = ',';
+            buffer[used++] = ' ';
+        }
+        memcpy(buffer + used, entry->key, entry->key_length);
+        used += entry->key_length;
+        buffer[used++] = '=';
+        used += format_tenths(buffer + used, s->min_temp);
+        buffer[used++] = '/';
+        used += format_tenths(buffer + used, round_mean(s->sum_temp, s->count));
+        buffer[used++] = '/';
+        used += format_tenths(buffer + used, s->max_temp);
+    }
+    buffer[used++] = '}';
+    buffer[used++] = '\n';
+
+    fflush(stdout);
+    for (size_t written = 0; written < used;) {
+        ssize_t result = write(STDOUT_FILENO, buffer + written, used - written);
+        if (result < 0) {
+            perror("Error writing results");
+            exit(EXIT_FAILURE);
+        }
+        written += result;
+    }
+
+    free(buffer);
+    free(sorted);
+}
+
+
+int32_t return_max(int32_t a, int32_t b) { return (a > b) ? a : b; }
+
+int32_t return_min(int32_t a, int32_t b) { return (a < b) ? a : b; }
+
+/*
+ * Slow path for anything that is not -?d.d or -?dd.d: accepts -?\d+(\.\d)?
+ * within -99.9..99.9 and rejects everything else.
+ */
+bool parse_temperature_checked(const char *start, const char *end,
+                               int32_t *tenths) {
+    const char *cursor = start;
+    bool negative = cursor < end && *cursor == '-';
+    if (negative) {
+        cursor++;
+    }
+
+    int32_t value = 0;
+    const char *digits_start = cursor;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+        value = value * 10 + (*cursor - '0');
+        if (value > 99) {
+            return false;
+        }
+        cursor++;
+    }
+    if (cursor == digits_start) {
+        return false;
+    }
+
+    value *= 10;
+    if (cursor < end && *cursor == '.') {
+        cursor++;
+        if (cursor == end || *cursor < '0' || *cursor > '9') {
+            return false;
         }
-        entry = entry->next;
+        value += *cursor - '0';
+        cursor++;
     }
-    return NULL;
+    if (cursor != end) {
+        return false;
+    }
+
+    *tenths = negative ? -value : value;
+    return true;
 }
 
-float calculate_average(int count, float average, float new_value) {
-    return ((average * count) + new_value) / (count + 1);
+/*
+ * Parses the temperature in [start, end) into tenths of a degree. The input
+ * is almost always -?d.d or -?dd.d, which is handled with a couple of
+ * compares and no float math; anything else falls back to the checked path.
+ */
+static inline bool parse_temperature(const char *start, const char *end,
+                                     int32_t *tenths) {
+    size_t length = end - start;
+    int32_t sign = 1;
+    const char *digits = start;
+    if (length > 0 && *digits == '-') {
+        sign = -1;
+        digits++;
+        length--;
+    }
+
+    if (length == 3 && digits[1] == '.') {
+        unsigned int ones = (unsigned char)digits[0] - '0';
+        unsigned int decimal = (unsigned char)digits[2] - '0';
+        if ((ones | decimal) < 10) {
+            *tenths = sign * (int32_t)(ones * 10 + decimal);
+            return true;
+        }
+    } else if (length == 4 && digits[2] == '.') {
+        unsigned int tens = (unsigned char)digits[0] - '0';
+        unsigned int ones = (unsigned char)digits[1] - '0';
+        unsigned int decimal = (unsigned char)digits[3] - '0';
+        if ((tens | ones | decimal) < 10) {
+            *tenths = sign * (int32_t)(tens * 100 + ones * 10 + decimal);
+            return true;
+        }
+    }
+
+    return parse_temperature_checked(start, end, tenths);
 }
 
-float return_max(float a, float b) { return (a > b) ? a : b; }
+void merge_station(Station *destination, const Station *source) {
+    destination->sum_temp += source->sum_temp;
+    destination->max_temp =
+        return_max(destination->max_temp, source->max_temp);
+    destination->min_temp =
+        return_min(destination->min_temp, source->min_temp);
+    destination->count += source->count;
+}
 
-float return_min(float a, float b) { return (a < b) ? a : b; }
+/* Folds every station of `source` into `destination`. */
+void merge_tables(HashTable *destination, HashTable *source) {
+    for (size_t i = 0; i < source->capacity; i++) {
+        Entry *entry = &source->entries[i];
+        if (entry->key == NULL) {
+            continue;
+        }
+
+        Station *existing_station =
+            ht_get(destination, entry->key, entry->key_length);
+        if (existing_station != NULL) {
+            merge_station(existing_station, &entry->value);
+        } else {
+            ht_set(destination, entry->key, entry->key_length, &entry->value);
+        }
+    }
+}
 
 void *process_data(void *threadarg) {
     thread_data *my_data = (thread_data *)threadarg;
@@ -135,7 +472,8 @@ void *process_data(void *threadarg) {
         char buffer[1024];
 
         pthread_mutex_lock(&file_semaphore);
-        printf("[Thread %d] Acquired file semaphore.\n", my_data->thread_id);
+        debug_print("[Thread %d] Acquired file semaphore.\n",
+                    my_data->thread_id);
         char *res = fgets(buffer, sizeof(buffer), my_data->file);
         if (res == NULL) {
             pthread_mutex_unlock(&file_semaphore);
@@ -144,67 +482,77 @@ void *process_data(void *threadarg) {
 
         *my_data->file_read_count += 1;
 
-        printf("[Thread %d] Read file times: %d.\n", my_data->thread_id,
-               *my_data->file_read_count);
+        debug_print("[Thread %d] Read file times: %d.\n", my_data->thread_id,
+                    *my_data->file_read_count);
 
-        printf("[Thread %d] Releasimg file semaphore.\n", my_data->thread_id);
+        debug_print("[Thread %d] Releasimg file semaphore.\n",
+                    my_data->thread_id);
         pthread_mutex_unlock(&file_semaphore);
 
-        char *station_name = strtok(buffer, ";");
-        if (station_name == NULL) {
-            printf("[Thread %d] Malformed line, skipping.\n",
-                   my_data->thread_id);
+        size_t line_length = strcspn(buffer, "\n");
+        char *separator = memchr(buffer, ';', line_length);
+        /* Lines without a station name are skipped, like in main.c. */
+        if (separator == NULL || separator == buffer) {
+            debug_print("[Thread %d] Malformed line, skipping.\n",
+                        my_data->thread_id);
             continue;
         }
+        *separator = '\0';
 
-        char *temperature_str = strtok(NULL, "\n");
+        char *station_name = buffer;
+        size_t name_length = separator - buffer;
 
-        if (temperature_str == NULL) {
-            printf("[Thread %d] Malformed line, skipping.\n",
-                   my_data->thread_id);
+        int32_t tenths;
+        if (!parse_temperature(separator + 1, buffer + line_length, &tenths)) {
+            debug_print("[Thread %d] Malformed line, skipping.\n",
+                        my_data->thread_id);
             continue;
         }
-        float temperature = atof(temperature_str);
 
-        pthread_mutex_lock(&table_semaphore);
-        printf("[Thread %d] Acquired table semaphore.\n", my_data->thread_id);
+        if (!USE_THREAD_LOCAL_TABLES) {
+            pthread_mutex_lock(&table_semaphore);
+            debug_print("[Thread %d] Acquired table semaphore.\n",
+                        my_data->thread_id);
+        }
 
-        Station *existing_station = ht_get(my_data->table, station_name);
+        Station *existing_station =
+            ht_get(my_data->table, station_name, name_length);
 
         if (existing_station != NULL) {
 
-            printf("[Thread %d] Found station: %s.\n", my_data->thread_id,
-                   existing_station->name);
+            debug_print("[Thread %d] Found station: %.*s.\n",
+                        my_data->thread_id, (int)name_length, station_name);
 
-            existing_station->average_temp =
-                calculate_average(existing_station->count,
-                                  existing_station->average_temp, temperature);
+            existing_station->sum_temp += tenths;
             existing_station->count += 1;
             existing_station->max_temp =
-                return_max(existing_station->max_temp, temperature);
+                return_max(existing_station->max_temp, tenths);
             existing_station->min_temp =
-                return_min(existing_station->min_temp, temperature);
+                return_min(existing_station->min_temp, tenths);
 
         } else {
 
-            printf("[Thread %d] Didn't Found station: %s. Creating new.\n",
-                   my_data->thread_id, station_name);
+            debug_print(
+                "[Thread %d] Didn't Found station: %s. Creating new.\n",
+                my_data->thread_id, station_name);
 
-            Station *s = malloc(sizeof(Station));
-            strncpy(s->name, station_name, sizeof(s->name) - 1);
-            s->average_temp = calculate_average(0, 0.0, temperature);
-            s->min_temp = temperature;
-            s->max_temp = temperature;
-            s->count = 1;
+            Station s = {0};
+            s.sum_temp = tenths;
+            s.min_temp = tenths;
+            s.max_temp = tenths;
+            s.count = 1;
 
-            ht_set(my_data->table, station_name, s);
+            ht_set(my_data->table, station_name, name_length, &s);
         }
 
-        printf("[Thread %d] Releasing table semaphore.\n", my_data->thread_id);
-        pthread_mutex_unlock(&table_semaphore);
+        if (!USE_THREAD_LOCAL_TABLES) {
+            debug_print("[Thread %d] Releasing table semaphore.\n",
+                        my_data->thread_id);
+            pthread_mutex_unlock(&table_semaphore);
+        }
     }
 
-    printf("[Thread %d] Exiting through the end\n", my_data->thread_id);
+    debug_print("[Thread %d] Exiting through the end\n", my_data->thread_id);
 
     pthread_exit(NULL);
 }
@@ -228,7 +576,7 @@ int main(void) {
     for (i = 0; i < NUMBER_OF_THREADS; i++) {
         td[i].file_read_count = &file_read_count;
         td[i].thread_id = i;
-        td[i].table = table;
+        td[i].table = USE_THREAD_LOCAL_TABLES ? create_table() : table;
         td[i].file = file;
         rc = pthread_create(&threads[i], NULL, process_data, (void *)&td[i]);
         if (rc) {
@@ -245,23 +593,16 @@ int main(void) {
             return (0);
         }
 
-        printf("Main: Completed join with thread %d\n", i);
-    }
+        debug_print("Main: Completed join with thread %d\n", i);
 
-    printf("Final Station Data:\n");
-
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        Entry *entry = table->entries[i];
-        while (entry != NULL) {
-            Station *s = entry->value;
-            printf("Station: %s, Avg Temp: %.2f, Min Temp: %.2f, Max Temp: "
-                   "%.2f, Count: %u\n",
-                   s->name, s->average_temp, s->min_temp, s->max_temp,
-                   s->count);
-            entry = entry->next; // advance
+        if (USE_THREAD_LOCAL_TABLES) {
+            merge_tables(table, td[i].table);
+            free_table(td[i].table);
         }
     }
 
+    print_results(table);
+
     free_table(table);
     fclose(file);
     return 0;